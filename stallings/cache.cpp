@@ -0,0 +1,137 @@
+/*
+*   This file is part of Stallings-Calculator.
+*
+*   Stallings-Calculator is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   NSMB Editor 5 is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with Stallings-Calculator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cache.hpp>
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+using namespace std;
+
+namespace stallings {
+
+namespace {
+
+// Most recently used first. The key is the operation followed by the
+// canonical forms of the operands.
+typedef list<pair<string, ResultCache::Result>> Entries;
+
+mutex cache_mutex;
+Entries entries;
+unordered_map<string, Entries::iterator> by_key;
+size_t bytes = 0;
+size_t limit = ResultCache::DEFAULT_LIMIT;
+long long hits[ResultCache::NUM_OPERATIONS];
+long long misses[ResultCache::NUM_OPERATIONS];
+
+string FullKey(ResultCache::Operation op, const string& key) {
+	return string(1, char('0' + op)) + key;
+}
+
+size_t EntryBytes(const pair<string, ResultCache::Result>& entry) {
+	// The key is also in the by_key.
+	size_t size = sizeof(entry) + 2 * entry.first.size();
+	for (const vector<vector<int>>& base : entry.second.bases) {
+		size += sizeof(base);
+		for (const vector<int>& element : base) size += sizeof(element) + element.size() * sizeof(int);
+	}
+	return size;
+}
+
+void Drop() {
+	while (bytes > limit) {
+		bytes -= EntryBytes(entries.back());
+		by_key.erase(entries.back().first);
+		entries.pop_back();
+	}
+}
+
+}  // namespace
+
+bool ResultCache::Find(Operation op, const string& key, Result& result) {
+	lock_guard<mutex> guard(cache_mutex);
+	auto it = by_key.find(FullKey(op, key));
+	if (it == by_key.end()) {
+		++misses[op];
+		return false;
+	}
+	++hits[op];
+	entries.splice(entries.begin(), entries, it->second);
+	result = it->second->second;
+	return true;
+}
+
+void ResultCache::Store(Operation op, const string& key, const Result& result) {
+	lock_guard<mutex> guard(cache_mutex);
+	pair<string, Result> entry(FullKey(op, key), result);
+	size_t size = EntryBytes(entry);
+	if (size > limit or by_key.count(entry.first)) return;
+	entries.push_front(move(entry));
+	by_key[entries.front().first] = entries.begin();
+	bytes += size;
+	Drop();
+}
+
+size_t ResultCache::Bytes() {
+	lock_guard<mutex> guard(cache_mutex);
+	return bytes;
+}
+
+size_t ResultCache::Limit() {
+	lock_guard<mutex> guard(cache_mutex);
+	return limit;
+}
+
+void ResultCache::SetLimit(size_t new_limit) {
+	lock_guard<mutex> guard(cache_mutex);
+	limit = new_limit;
+	Drop();
+}
+
+int ResultCache::Size() {
+	lock_guard<mutex> guard(cache_mutex);
+	return entries.size();
+}
+
+long long ResultCache::Hits(Operation op) {
+	lock_guard<mutex> guard(cache_mutex);
+	return hits[op];
+}
+
+long long ResultCache::Misses(Operation op) {
+	lock_guard<mutex> guard(cache_mutex);
+	return misses[op];
+}
+
+const char* ResultCache::Name(Operation op) {
+	static const char* names[NUM_OPERATIONS] = {
+		"fringe", "algext", "intersection", "free factor"
+	};
+	return names[op];
+}
+
+void ResultCache::Clear() {
+	lock_guard<mutex> guard(cache_mutex);
+	entries.clear();
+	by_key.clear();
+	bytes = 0;
+	for (int op = 0; op < NUM_OPERATIONS; ++op) hits[op] = misses[op] = 0;
+}
+
+}  // namespace stallings
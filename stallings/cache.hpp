@@ -0,0 +1,65 @@
+/*
+*   This file is part of Stallings-Calculator.
+*
+*   Stallings-Calculator is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   NSMB Editor 5 is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with Stallings-Calculator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include <string>
+#include <vector>
+
+namespace stallings {
+
+// Results of the expensive operations on subgroups (see Subgroup), by the
+// canonical forms of the operands. Asking again for the same subgroups, even
+// by another base, costs nothing. The results are kept as the bases of the
+// subgroups they return, and the least recently used ones are dropped when
+// they take more than the limit.
+class ResultCache {
+ public:
+	enum Operation { FRINGE, ALGEBRAIC_EXTENSIONS, INTERSECTION, FREE_FACTOR, NUM_OPERATIONS };
+
+	struct Result {
+		Result() : value(false) {}
+
+		std::vector<std::vector<std::vector<int>>> bases;
+		bool value;
+	};
+
+	// Return true and set 'result' if it is in the cache.
+	static bool Find(Operation op, const std::string& key, Result& result);
+	static void Store(Operation op, const std::string& key, const Result& result);
+
+	// Approximate memory used by the results, and its limit. A limit of 0 turns
+	// off the cache.
+	static size_t Bytes();
+	static size_t Limit();
+	static void SetLimit(size_t bytes);
+
+	static int Size();
+	static long long Hits(Operation op);
+	static long long Misses(Operation op);
+	static const char* Name(Operation op);
+
+	// Drop every result, and reset the counters.
+	static void Clear();
+
+	const static size_t DEFAULT_LIMIT = 64 << 20;
+};
+
+}  // namespace stallings
+
+#endif // CACHE_HPP
@@ -17,83 +17,274 @@
 
 #include <folding.hpp>
 #include <cassert>
+#include <cstdlib>
+#include <algorithm>
+#include <tuple>
 
 using namespace std;
 
 namespace stallings {
 
+namespace {
+
+vector<int> Inverse(const vector<int>& w) {
+	vector<int> inverse(w.rbegin(), w.rend());
+	for (int& letter : inverse) letter = -letter;
+	return inverse;
+}
+
+// w = w * x, reduced if both were.
+void Multiply(vector<int>& w, const vector<int>& x) {
+	for (int letter : x) {
+		if (not w.empty() and w.back() == -letter) w.pop_back();
+		else w.push_back(letter);
+	}
+}
+
+}  // namespace
+
 void Folding::Show() const {
 	graph.Show();
 	cout << "Folding edges " << u << "-" << v << " and ";
 	cout << u << "-" << w << ", with label " << (label > 0 ? "" : "-") << char(abs(label) + 'a' - 1) << "." << endl;
 }
 
-Path Folding::RaisePath(const Path& path) const {
-	Path newpath;
-	int pos = 0; // Start at the base node
-	for (const Edge& edge : path) {
-		int next = edge.v;
-		if (next >= w and w != v) ++next; // Indexes greater than w are displaced because of erasing w
-		if (next == v or next == w) {
-			if ((not graph.HasExactEdge(pos, edge.label, v)) and not graph.HasExactEdge(pos, edge.label, w)) {
-				// Lets go back through the folding for free
-				int ori = v, dest = w;
-				if (pos == w) swap(ori, dest);
-				assert(pos == ori);
-				newpath.push_back(Edge(u, -label));
-				newpath.push_back(Edge(dest, label));
-				pos = dest;
+void Folding::Apply(Graph& newgraph) {
+	Graph::Swap(graph, newgraph);
+	const Graph& oldgraph = graph;
+	
+	if (v == w) {
+		// Copy the whole graph without one edge u-w
+		newgraph = Graph(oldgraph.Size());
+		bool skip = false, skiprev = false;
+		for (int i = 0; i < oldgraph.Size(); ++i) {
+			for (const Edge& edge : oldgraph.const_list(i)) {
+				if (skip or i != u or edge.v != w or edge.label != label) {
+					if (skiprev or i != w or edge.v != u or edge.label != -label) {
+						newgraph.AddSingleEdge(i, edge.v, edge.label);
+					} else {
+						skiprev = true;
+					}
+				} else {
+					skip = true;
+				}
 			}
-			bool b1 = graph.HasExactEdge(pos, edge.label, v);
-			bool b2 = graph.HasExactEdge(pos, edge.label, w);
-			assert(b1 or b2);
-			if (b1) pos = v;
-			else pos = w;
-			newpath.push_back(Edge(pos, edge.label));
 		}
-		else {
-			if (not graph.HasExactEdge(pos, edge.label, next)) {
-				// Lets go back through the folding for free
-				int ori = v, dest = w;
-				if (pos == w) swap(ori, dest);
-				assert(pos == ori);
-				newpath.push_back(Edge(u, -label));
-				newpath.push_back(Edge(dest, label));
-				pos = dest;
+		assert(skip and skiprev);
+	} else {
+		// Ensure v < w. As we'll merge them both into v, if one of
+		// them is the 0, the result will still be 0.
+		if (v > w) swap(v, w);
+		bool skip = false, skiprev = false;
+		newgraph = Graph(oldgraph.Size() - 1);
+		for (int i = 0; i < oldgraph.Size(); ++i) {
+			int ni = i;
+			if (ni == w) ni = v;
+			else if (ni > w) --ni;
+			for (const Edge& edge : oldgraph.const_list(i)) {
+				int nv = edge.v;
+				if (nv == w) nv = v;
+				else if (nv > w) --nv;
+				if (skip or i != u or edge.v != w or edge.label != label) {
+					if (skiprev or i != w or edge.v != u or edge.label != -label) {
+						newgraph.AddSingleEdge(ni, nv, edge.label);
+					} else {
+						skiprev = true;
+					}
+				} else {
+					skip = true;
+				}
 			}
-			assert(graph.HasExactEdge(pos, edge.label, next));
-			newpath.push_back(Edge(next, edge.label));
-			pos = next;
 		}
+		assert(skip and skiprev);
 	}
-	if (pos != 0) {
-		assert(pos == w and v == 0);
-		newpath.push_back(Edge(u, -label));
-		newpath.push_back(Edge(0, label));
-	}
-
-	// Clean back edges
-	bool goback = false;
-	do {
-		goback = false;
-		int prev = 0;
-		int pos = newpath[0].v;
-		for (int i = 1; i < int(newpath.size()); ++i) {
-			if (newpath[i].v == prev and newpath[i].label == -newpath[i - 1].label) {
-				Path another;
-				for (int j = 0; j < int(newpath.size()); ++j) {
-					if (j != i and j != i - 1) another.push_back(newpath[j]);
-				}
-				swap(another, newpath);
-				goback = true;
-				break;
+}
+
+FoldHistory::FoldHistory(const Graph& graph) : original(graph) {
+	Graph folded = graph;
+	Folding fold;
+	while (folded.FindRepeatedEdge(fold.u, fold.v, fold.w, fold.label)) {
+		fold.Apply(folded);
+		fold.graph = Graph();
+		steps.push_back(fold);
+	}
+}
+
+void FoldHistory::Replay(const function<void(const Folding&)>& f) const {
+	Graph graph = original;
+	for (const Folding& step : steps) {
+		Folding fold = step;
+		fold.Apply(graph);
+		f(fold);
+	}
+}
+
+Folder::Folder(const Graph& graph) : num_vertex(graph.Size()), max_label(0),
+		sets(graph.Size()), out(graph.Size()), track_words(false) {
+	// Every edge u --(label)--> v with label > 0 is listed together with its
+	// reverse v --(-label)--> u. Number the positive ones and match every
+	// negative one with its reverse, keeping the order of the adjacency lists.
+	vector<tuple<int, int, int, int>> positive, negative;
+	for (int u = 0; u < num_vertex; ++u) {
+		const Adj& adj = graph.const_list(u);
+		out[u].resize(adj.size());
+		for (int i = 0; i < int(adj.size()); ++i) {
+			const Edge& edge = adj[i];
+			max_label = max(max_label, abs(edge.label));
+			if (edge.label > 0) {
+				int e = to.size();
+				to.push_back(edge.v); label.push_back(edge.label);
+				to.push_back(u); label.push_back(-edge.label);
+				out[u][i] = e;
+				positive.push_back(make_tuple(u, edge.v, edge.label, e));
+			} else {
+				negative.push_back(make_tuple(edge.v, u, -edge.label, i));
 			}
-			prev = pos;
-			pos = newpath[i].v;
 		}
-	} while (goback);
+	}
+	sort(positive.begin(), positive.end());
+	sort(negative.begin(), negative.end());
+	assert(positive.size() == negative.size());
+	for (int i = 0; i < int(positive.size()); ++i) {
+		assert(get<0>(positive[i]) == get<0>(negative[i]));
+		assert(get<1>(positive[i]) == get<1>(negative[i]));
+		assert(get<2>(positive[i]) == get<2>(negative[i]));
+		out[get<1>(negative[i])][get<3>(negative[i])] = get<3>(positive[i]) + 1;
+	}
+	dead.assign(to.size() / 2, false);
+}
+
+void Folder::SetEdgeWord(int u, int i, const vector<int>& w) {
+	if (not track_words) {
+		track_words = true;
+		word.resize(to.size() / 2);
+		weight.resize(num_vertex);
+	}
+	int e = out[u][i];
+	if (e % 2 == 0) word[e / 2] = w;
+	else word[e / 2] = Inverse(w);
+}
 
-	return newpath;
+vector<int> Folder::EdgeWord(int e) const {
+	if (e % 2 == 0) return word[e / 2];
+	return Inverse(word[e / 2]);
+}
+
+int Folder::Find(int u) {
+	if (track_words) return FindWithWord(u);
+	return sets.Find(u);
+}
+
+int Folder::FindWithWord(int u) {
+	vector<int> path;
+	for (int x = u; sets.Parent(x) != x; x = sets.Parent(x)) path.push_back(x);
+	if (path.empty()) return u;
+	int root = sets.Parent(path.back());
+	// The word from the root to x is the word from the root to its parent,
+	// times weight[x].
+	for (int i = int(path.size()) - 2; i >= 0; --i) {
+		int x = path[i];
+		vector<int> w = weight[sets.Parent(x)];
+		Multiply(w, weight[x]);
+		weight[x] = move(w);
+		sets.SetParent(x, root);
+	}
+	return root;
+}
+
+void Folder::Insert(int r, int e) {
+	long long key = (long long)r * (2 * max_label + 1) + label[e] + max_label;
+	auto it = edge_with_label.find(key);
+	if (it != edge_with_label.end() and not dead[it->second / 2]) {
+		// Fold e over the edge already there.
+		dead[e / 2] = true;
+		pending.push_back(make_pair(e, it->second));
+	} else edge_with_label[key] = e;
+}
+
+void Folder::Merge(int e, int f) {
+	int u = Find(to[f]);
+	int v = Find(to[e]);
+	if (u == v) return;
+	// The base vertex stays the root of its class, so that the words of the
+	// closed paths at it do not need to be conjugated.
+	if ((out[u].size() < out[v].size() and u != 0) or v == 0) swap(u, v);
+	if (track_words) {
+		// Both edges start in the same class. Take the words of the paths from
+		// its root through e and f to the roots of their ends: the edges are
+		// identified, so those paths must have the same word. The root left
+		// under the other one gets the difference.
+		if (u != FindWithWord(to[f])) swap(e, f);
+		FindWithWord(to[e]);
+		FindWithWord(to[e ^ 1]);
+		FindWithWord(to[f ^ 1]);
+		vector<int> we = weight[to[e ^ 1]];
+		Multiply(we, EdgeWord(e));
+		Multiply(we, Inverse(weight[to[e]]));
+		vector<int> wf = weight[to[f ^ 1]];
+		Multiply(wf, EdgeWord(f));
+		Multiply(wf, Inverse(weight[to[f]]));
+		weight[v] = Inverse(wf);
+		Multiply(weight[v], we);
+	}
+	sets.Link(u, v);
+	for (int edge : out[v]) {
+		if (dead[edge / 2]) continue;
+		out[u].push_back(edge);
+		Insert(u, edge);
+	}
+	out[v] = vector<int>();
+}
+
+Graph Folder::Fold() {
+	vector<vector<int>> original_out = out;
+	edge_with_label.reserve(to.size());
+	for (int u = 0; u < num_vertex; ++u) {
+		for (int e : original_out[u]) Insert(u, e);
+	}
+	// The classes do not depend on the order of the merges. With words, they
+	// go in the order found, so that the classes grow from the base vertex
+	// out, as with one folding at a time, and the words stay short.
+	if (track_words) {
+		for (size_t k = 0; k < pending.size(); ++k) {
+			pair<int, int> p = pending[k];
+			Merge(p.first, p.second);
+		}
+		pending.clear();
+	}
+	while (not pending.empty()) {
+		pair<int, int> p = pending.back();
+		pending.pop_back();
+		Merge(p.first, p.second);
+	}
+
+	// Compact the ids. The first original vertex of every class gives its order.
+	vector<int> id(num_vertex, -1);
+	int nodes = 0;
+	vertex_map.resize(num_vertex);
+	for (int u = 0; u < num_vertex; ++u) {
+		int r = Find(u);
+		if (id[r] == -1) id[r] = nodes++;
+		vertex_map[u] = id[r];
+	}
+
+	Graph folded(nodes);
+	for (int u = 0; u < num_vertex; ++u) {
+		for (int e : original_out[u]) {
+			if (not dead[e / 2]) folded.AddSingleEdge(vertex_map[u], vertex_map[to[e]], label[e]);
+		}
+	}
+	return folded;
+}
+
+vector<vector<int>> Folder::VertexWords() {
+	vector<vector<int>> words(num_vertex);
+	if (not track_words) return words;  // No word was given, they are all 1.
+	for (int u = 0; u < num_vertex; ++u) {
+		FindWithWord(u);
+		words[u] = weight[u];
+	}
+	return words;
 }
 
 }  // namespace stallings
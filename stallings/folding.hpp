@@ -20,6 +20,11 @@
 
 #include <graph.hpp>
 
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
 namespace stallings {
 
 // Stores a graph and the folding applied to that graph.
@@ -32,7 +37,9 @@ class Folding {
 
 	void Show() const;
 
-	Path RaisePath(const Path& path) const;
+	// Perform the folding in 'graph', storing the previous graph in 'graph'
+	// of the folding. Sorts v and w if the folding merges them.
+	void Apply(Graph& graph);
 
 	Graph graph;
 
@@ -40,6 +47,94 @@ class Folding {
 	int u, v, w, label;
 };
 
+// The foldings applied to a graph one by one, without a copy of the graph
+// before every one of them: only the folded edges are kept, and the graphs
+// are rebuilt from the original one by applying them again.
+class FoldHistory {
+ public:
+	FoldHistory() {}
+	explicit FoldHistory(const Graph& graph);
+
+	int Size() const {
+		return steps.size();
+	}
+
+	// The folding i, without its graph.
+	const Folding& operator[](int i) const {
+		return steps[i];
+	}
+
+	// Call f with every folding, in order, and its graph.
+	void Replay(const std::function<void(const Folding&)>& f) const;
+
+ private:
+	Graph original;
+	std::vector<Folding> steps;
+};
+
+// Folds a whole graph at once. Instead of looking for a repeated edge and
+// rebuilding the graph for every single folding, the pending collisions are
+// kept in a worklist and the vertices are merged with a union-find structure
+// (smaller adjacency list into the bigger one). Vertex ids are compacted only
+// at the end, keeping the relative order of the original vertices, so the
+// result is numbered as the graph obtained by applying the foldings one by one.
+class Folder {
+ public:
+	explicit Folder(const Graph& graph);
+
+	// Return the folded graph.
+	Graph Fold();
+
+	// Vertex of the folded graph where every original vertex ends up.
+	// Only valid after Fold().
+	const std::vector<int>& VertexMap() const {
+		return vertex_map;
+	}
+
+	// Gives a word to the edge at position i of the adjacency list of u (and
+	// its inverse to the reverse edge), 1 by default. Must be called before
+	// Fold().
+	void SetEdgeWord(int u, int i, const std::vector<int>& word);
+
+	// For every original vertex, the product of the words along a path of the
+	// original graph from the root of its class to it, whose label reduces to
+	// 1. The base vertex is the root of its class. Only valid after Fold().
+	std::vector<std::vector<int>> VertexWords();
+
+ private:
+	int Find(int u);
+	// Also compresses the path of u, so that weight[u] is the word from the
+	// root of its class to u.
+	int FindWithWord(int u);
+	void Merge(int e, int f);
+
+	// Word of the directed edge e.
+	std::vector<int> EdgeWord(int e) const;
+
+	// Register the (directed) edge e in the adjacency of the class r, queueing
+	// a merge if r already has an edge with the same label.
+	void Insert(int r, int e);
+
+	int num_vertex;
+	int max_label;
+
+	// Directed edge e goes --(label[e])--> to[e]. Edge e ^ 1 is its reverse,
+	// and dead[e / 2] is set when the pair has been folded away.
+	std::vector<int> to, label;
+	std::vector<bool> dead;
+
+	DisjointSet sets;  // Classes of vertices, linked in Merge.
+	std::vector<std::vector<int>> out;  // Outgoing edges of every class.
+	std::unordered_map<long long, int> edge_with_label;  // (class, label) -> edge.
+	std::vector<std::pair<int, int>> pending;  // Edges folded, their ends must be merged.
+	std::vector<int> vertex_map;
+
+	// Words of the edges (of the positive direction of every pair), and of the
+	// path from the parent of every vertex to it. Only if track_words.
+	bool track_words;
+	std::vector<std::vector<int>> word, weight;
+};
+
 }  // namespace stallings
 
 #endif // FOLDING_HPP
@@ -17,21 +17,22 @@
 
 #include <graph.hpp>
 
+#include <algorithm>
 #include <iostream>
 #include <cstdlib>
 #include <cassert>
-#include <functional>
 #include <map>
 #include <queue>
 #include <set>
 #include <stack>
+#include <unordered_map>
 
 using namespace std;
 
 namespace stallings {
 
-void Edge::Show() const {
-	cout << "(" << v << "," << (label > 0 ? "" : "-") << char(abs(label) + 'a' - 1) << ")";
+void Edge::Show(ostream& out) const {
+	out << "(" << v << "," << (label > 0 ? "" : "-") << char(abs(label) + 'a' - 1) << ")";
 }
 
 void Graph::AddEdge(int u, int v, int label) {
@@ -105,19 +106,30 @@ void Graph::AllShortestPaths(std::vector<Edge>& prev, std::vector<int>& dist) co
 	}
 }
 
+DisjointSet::DisjointSet(int n) : parent(n), size(n, 1) {
+	for (int i = 0; i < n; ++i) parent[i] = i;
+}
+
+bool DisjointSet::Union(int u, int v) {
+	u = Find(u);
+	v = Find(v);
+	if (u == v) return false;
+	if (size[u] < size[v]) swap(u, v);
+	Link(u, v);
+	return true;
+}
+
+void DisjointSet::Link(int u, int v) {
+	parent[v] = u;
+	size[u] += size[v];
+}
+
 void Graph::ComputeSpanningTree(Graph& st, vector<tuple<int, int, int>>& not_used) const {
 	st = Graph(num_vertex);
-	vector<int> root(num_vertex);
-	for (int i = 0; i < num_vertex; ++i) root[i] = i;
-	function<int(int)> Root = [&root, &Root](int u) -> int {
-		if (root[u] == u) return u;
-		return root[u] = Root(root[u]);
-	};
+	DisjointSet sets(num_vertex);
 	for (int i = 0; i < num_vertex; ++i) {
 		for (const Edge& edge : list[i]) {
-			int ri = Root(i), rj = Root(edge.v);
-			if (ri != rj) {
-				root[ri] = rj;
+			if (sets.Union(i, edge.v)) {
 				st.AddEdge(i, edge.v, edge.label);
 			} else if (i < edge.v or (i == edge.v and edge.label > 0))
 				// We need the if to avoid repeating edges.
@@ -126,6 +138,28 @@ void Graph::ComputeSpanningTree(Graph& st, vector<tuple<int, int, int>>& not_use
 	}
 }
 
+void Graph::ComputeGeodesicTree(Graph& st, vector<tuple<int, int, int>>& not_used) const {
+	st = Graph(num_vertex);
+	vector<Edge> prev;
+	vector<int> dist;
+	AllShortestPaths(prev, dist);
+	// Edge prev[v] goes back from v to its parent. Each one is found twice, from
+	// the parent and from v, and only the first copy of it is in the tree.
+	vector<bool> down(num_vertex, false), up(num_vertex, false);
+	for (int i = 0; i < num_vertex; ++i) {
+		for (const Edge& edge : list[i]) {
+			if (dist[edge.v] > 0 and not down[edge.v] and prev[edge.v].v == i and prev[edge.v].label == -edge.label) {
+				down[edge.v] = true;
+				st.AddEdge(i, edge.v, edge.label);
+			} else if (dist[i] > 0 and not up[i] and prev[i].v == edge.v and prev[i].label == edge.label) {
+				up[i] = true;
+			} else if (i < edge.v or (i == edge.v and edge.label > 0)) {
+				not_used.push_back(make_tuple(i, edge.v, edge.label));
+			}
+		}
+	}
+}
+
 void Graph::ComputeQuotient(Graph& qt, const std::vector<int>& relation) const {
 	assert(num_vertex == int(relation.size()));
 
@@ -174,22 +208,23 @@ bool Graph::IsIsomorphic(const Graph& g) const {
 	return true;
 }
 
-void Graph::Show() const {
+void Graph::Show(ostream& out) const {
 	assert(int(list.size()) == num_vertex);
-	cout << list.size() << endl;
+	out << list.size() << '\n';
 	for (int i = 0; i < num_vertex; ++i) {
-		cout << i << ":";
+		out << i << ":";
 		for (const Edge& edge : list[i]) {
-			cout << " ";
-			edge.Show();
+			out << " ";
+			edge.Show(out);
 		}
-		cout << endl;
+		out << '\n';
 	}
 }
 
 void Graph::Swap(Graph& g1, Graph& g2) {
 	swap(g1.list, g2.list);
 	swap(g1.num_vertex, g2.num_vertex);
+	swap(g1.max_label, g2.max_label);
 }
 
 vector<vector<pair<int, int>>> Graph::ListEdgesByLabel() const {
@@ -205,31 +240,347 @@ vector<vector<pair<int, int>>> Graph::ListEdgesByLabel() const {
 	return res;
 }
 
-Graph Graph::PullBack(const Graph& gH, const Graph& gK) {
-	Graph pb;
+namespace {
+
+// Index of the pairs (p, q) found in the pullback of gH and gK, -1 if not found
+// yet. Small tables are indexed directly, otherwise with a hash.
+class PairIndex {
+ public:
+	PairIndex(int nH, int nK) : nK(nK), use_table((long long)nH * nK <= Graph::MAX_PAIR_TABLE) {
+		if (use_table) table = vector<int>(nH * nK, -1);
+	}
+
+	int& operator()(int p, int q) {
+		if (use_table) return table[p * nK + q];
+		return hash.insert(make_pair((long long)p * nK + q, -1)).first->second;
+	}
+
+ private:
+	int nK;
+	bool use_table;
+	vector<int> table;
+	unordered_map<long long, int> hash;
+};
+
+// Breadth first search of the component of 'seed' in the pullback. As both
+// graphs are folded, every pair has at most one neighbour with each label.
+// The pairs are numbered from 0 (the seed) in the order they are found.
+Graph ExploreComponent(const FoldedGraph& gH, const FoldedGraph& gK, pair<int, int> seed,
+		PairIndex& index, vector<pair<int, int>>& pairs) {
+	Graph pb(1);
+	pairs = vector<pair<int, int>>(1, seed);
+	index(seed.first, seed.second) = 0;
+	for (int i = 0; i < int(pairs.size()); ++i) {
+		int q = pairs[i].second;
+		gH.ForEachEdge(pairs[i].first, [&](int label, int v) {
+			int w = gK.Next(q, label);
+			if (w == -1) return;
+			int& id = index(v, w);
+			if (id == -1) {
+				id = pairs.size();
+				pairs.push_back(make_pair(v, w));
+				pb.AddVertex();
+			}
+			// The reverse edge is added when exploring (v, w).
+			pb.AddSingleEdge(i, id, label);
+		});
+	}
+	return pb;
+}
+
+// Remove the vertices of degree one (but 'root', if it isn't -1) until there
+// are none, and compact the ids. kept[i] is the old id of the new vertex i.
+Graph Trim(Graph& g, int root, vector<int>& kept) {
+	int n = g.Size();
+	vector<int> deg(n);
+	queue<int> leaves;
+	for (int i = 0; i < n; ++i) {
+		deg[i] = g[i].size();
+		if (i != root and deg[i] == 1) leaves.push(i);
+	}
+	while (not leaves.empty()) {
+		int u = leaves.front();
+		leaves.pop();
+		deg[u] = 0;
+		for (const Edge& edge : g[u]) {
+			if (deg[edge.v] > 0 and --deg[edge.v] == 1 and edge.v != root) leaves.push(edge.v);
+		}
+	}
 
-	vector<vector<pair<int, int>>> lH = gH.ListEdgesByLabel();
-	vector<vector<pair<int, int>>> lK = gK.ListEdgesByLabel();
+	vector<int> id(n, -1);
+	kept.clear();
+	for (int i = 0; i < n; ++i) {
+		if (i == root or deg[i] > 0) {
+			id[i] = kept.size();
+			kept.push_back(i);
+		}
+	}
+	Graph core(kept.size());
+	for (int i : kept) {
+		for (const Edge& edge : g[i]) {
+			if (id[edge.v] != -1) core.AddSingleEdge(id[i], id[edge.v], edge.label);
+		}
+	}
+	return core;
+}
+
+}  // namespace
 
-	map<pair<int, int>, int> mindex;
-	mindex[make_pair(0, 0)] = 0;
-	auto Index = [&mindex](int u, int v) {
-		if (mindex.count(make_pair(u, v))) return mindex[make_pair(u, v)];
-		return mindex[make_pair(u, v)] = mindex.size();
-	};
+Graph Graph::CorePullBack(const FoldedGraph& gH, const FoldedGraph& gK) {
+	PairIndex index(gH.Size(), gK.Size());
+	vector<pair<int, int>> pairs;
+	vector<int> kept;
+	Graph pb = ExploreComponent(gH, gK, make_pair(0, 0), index, pairs);
+	return Trim(pb, 0, kept);
+}
 
-	int nlabel = min(lH.size(), lK.size());
-	for (int l = 1; l < nlabel; ++l) {
-		for (const pair<int, int>& eH : lH[l]) {
-			for (const pair<int, int>& eK : lK[l]) {
-				int idu = Index(eH.first, eK.first), idv = Index(eH.second, eK.second);
-				if (max(idu, idv) >= pb.Size()) pb.Resize(max(idu, idv) + 1);
-				pb.AddEdge(idu, idv, l);
+vector<Graph> Graph::PullBackComponents(const FoldedGraph& gH, const FoldedGraph& gK,
+		vector<pair<int, int>>& roots) {
+	vector<Graph> components;
+	roots.clear();
+	PairIndex index(gH.Size(), gK.Size());
+	vector<pair<int, int>> pairs;
+	vector<int> kept;
+	for (int p = 0; p < gH.Size(); ++p) {
+		for (int q = 0; q < gK.Size(); ++q) {
+			if (index(p, q) != -1) continue;
+			Graph pb = ExploreComponent(gH, gK, make_pair(p, q), index, pairs);
+			bool main = (p == 0 and q == 0);
+			Graph core = Trim(pb, main ? 0 : -1, kept);
+			if (core.Size() == 0 or (core.Size() == 1 and core[0].empty())) continue;
+			components.push_back(move(core));
+			roots.push_back(pairs[kept[0]]);
+		}
+	}
+	return components;
+}
+
+FoldedGraph::FoldedGraph(const Graph& graph) : num_vertex(graph.Size()),
+		max_label(0), offset_data(num_vertex + 1, 0) {
+	for (int i = 0; i < num_vertex; ++i) {
+		for (const Edge& edge : graph.const_list(i)) max_label = max(max_label, abs(edge.label));
+		offset_data[i + 1] = offset_data[i] + graph.const_list(i).size();
+	}
+	// Use the table unless it is more than twice as big as the rows.
+	long long table_size = (long long)num_vertex * 2 * max_label;
+	dense = table_size <= 2 * (num_vertex + 2LL * offset_data[num_vertex]);
+	if (dense) {
+		table_data = vector<int>(table_size, -1);
+		for (int i = 0; i < num_vertex; ++i) {
+			for (const Edge& edge : graph.const_list(i)) {
+				int& v = table_data[i * 2 * max_label + Column(edge.label)];
+				assert(v == -1);  // The graph must be folded.
+				v = edge.v;
 			}
 		}
+		offset_data.clear();
+	} else {
+		edge_data.reserve(offset_data[num_vertex]);
+		for (int i = 0; i < num_vertex; ++i) {
+			for (const Edge& edge : graph.const_list(i)) edge_data.push_back(edge);
+		}
 	}
+	Point();
+}
 
-	return pb;
+FoldedGraph::FoldedGraph(const FoldedGraph& g) {
+	*this = g;
+}
+
+FoldedGraph::FoldedGraph(FoldedGraph&& g) {
+	*this = move(g);
+}
+
+FoldedGraph& FoldedGraph::operator=(const FoldedGraph& g) {
+	num_vertex = g.num_vertex;
+	max_label = g.max_label;
+	dense = g.dense;
+	table_data = g.table_data;
+	offset_data = g.offset_data;
+	edge_data = g.edge_data;
+	storage = g.storage;
+	table = g.table;
+	offset = g.offset;
+	edges = g.edges;
+	if (not storage) Point();
+	return *this;
+}
+
+FoldedGraph& FoldedGraph::operator=(FoldedGraph&& g) {
+	num_vertex = g.num_vertex;
+	max_label = g.max_label;
+	dense = g.dense;
+	table_data = move(g.table_data);
+	offset_data = move(g.offset_data);
+	edge_data = move(g.edge_data);
+	storage = move(g.storage);
+	table = g.table;
+	offset = g.offset;
+	edges = g.edges;
+	if (not storage) Point();
+	return *this;
+}
+
+void FoldedGraph::Point() {
+	table = table_data.data();
+	offset = offset_data.data();
+	edges = edge_data.data();
+}
+
+void FoldedGraph::Serialize(vector<int>& out) const {
+	out.push_back(num_vertex);
+	out.push_back(max_label);
+	out.push_back(dense);
+	if (dense) {
+		out.insert(out.end(), table, table + (long long)num_vertex * 2 * max_label);
+	} else {
+		out.insert(out.end(), offset, offset + num_vertex + 1);
+		for (int i = 0; i < offset[num_vertex]; ++i) {
+			out.push_back(edges[i].v);
+			out.push_back(edges[i].label);
+		}
+	}
+}
+
+bool FoldedGraph::View(const int* data, int size, shared_ptr<const void> storage,
+		FoldedGraph& graph) {
+	static_assert(sizeof(Edge) == 2 * sizeof(int), "Edges are read as pairs of ints");
+	if (not storage or size < 3 or data[0] < 1 or data[1] < 0 or data[2] < 0 or data[2] > 1) return false;
+	FoldedGraph g;
+	g.num_vertex = data[0];
+	g.max_label = data[1];
+	g.dense = data[2];
+	data += 3;
+	size -= 3;
+	if (g.dense) {
+		if ((long long)g.num_vertex * 2 * g.max_label != size) return false;
+		g.table = data;
+	} else {
+		if (size < g.num_vertex + 1) return false;
+		g.offset = data;
+		if (g.offset[0] != 0 or size != g.num_vertex + 1 + 2LL * g.offset[g.num_vertex]) return false;
+		g.edges = reinterpret_cast<const Edge*>(data + g.num_vertex + 1);
+	}
+
+	// The queries follow the edges without checking them, so a corrupted
+	// graph must not get through. It must also be folded: at most one edge
+	// of every label in every vertex, and every edge with its reverse.
+	if (g.dense) {
+		for (int i = 0; i < size; ++i) {
+			if (g.table[i] < -1 or g.table[i] >= g.num_vertex) return false;
+		}
+		for (int u = 0; u < g.num_vertex; ++u) {
+			for (int c = 0; c < 2 * g.max_label; ++c) {
+				int v = g.table[u * 2 * g.max_label + c];
+				if (v != -1 and g.Next(v, -g.Label(c)) != u) return false;
+			}
+		}
+	} else {
+		for (int u = 0; u < g.num_vertex; ++u) {
+			if (g.offset[u + 1] < g.offset[u]) return false;
+		}
+		for (int i = 0; i < g.offset[g.num_vertex]; ++i) {
+			const Edge& edge = g.edges[i];
+			if (edge.v < 0 or edge.v >= g.num_vertex or edge.label == 0 or
+					edge.label > g.max_label or edge.label < -g.max_label) {
+				return false;
+			}
+		}
+		// The edges of every vertex sorted by label, to look for the repeated
+		// ones and for the reverse edges.
+		vector<Edge> sorted(g.edges, g.edges + g.offset[g.num_vertex]);
+		auto ByLabel = [](const Edge& a, const Edge& b) { return a.label < b.label; };
+		for (int u = 0; u < g.num_vertex; ++u) {
+			sort(sorted.begin() + g.offset[u], sorted.begin() + g.offset[u + 1], ByLabel);
+			for (int i = g.offset[u] + 1; i < g.offset[u + 1]; ++i) {
+				if (sorted[i].label == sorted[i - 1].label) return false;
+			}
+		}
+		for (int u = 0; u < g.num_vertex; ++u) {
+			for (int i = g.offset[u]; i < g.offset[u + 1]; ++i) {
+				const Edge& edge = sorted[i];
+				auto end = sorted.begin() + g.offset[edge.v + 1];
+				auto reverse = lower_bound(sorted.begin() + g.offset[edge.v], end,
+						Edge(0, -edge.label), ByLabel);
+				if (reverse == end or reverse->label != -edge.label or reverse->v != u) return false;
+			}
+		}
+	}
+	g.table_data.clear();
+	g.offset_data.clear();
+	g.storage = storage;
+	graph = move(g);
+	return true;
+}
+
+int FoldedGraph::Degree(int u) const {
+	if (not dense) return offset[u + 1] - offset[u];
+	int degree = 0;
+	for (int c = 0; c < 2 * max_label; ++c) {
+		if (table[u * 2 * max_label + c] != -1) ++degree;
+	}
+	return degree;
+}
+
+bool FoldedGraph::IsIsomorphic(const FoldedGraph& g) const {
+	if (num_vertex != g.num_vertex or max_label != g.max_label) return false;
+	// Both graphs are deterministic, so the isomorphism is fixed by the root.
+	vector<int> v(num_vertex, -1);
+	v[0] = 0;
+	stack<int> st;
+	st.push(0);
+	while (not st.empty()) {
+		int u = st.top();
+		st.pop();
+		int u2 = v[u];
+		if (Degree(u) != g.Degree(u2)) return false;
+		auto Visit = [&](int label, int next) -> bool {
+			int n2 = g.Next(u2, label);
+			if (n2 == -1) return false;
+			if (v[next] == -1) {
+				v[next] = n2;
+				st.push(next);
+			}
+			return v[next] == n2;
+		};
+		if (dense) {
+			for (int c = 0; c < 2 * max_label; ++c) {
+				int next = table[u * 2 * max_label + c];
+				if (next != -1 and not Visit(Label(c), next)) return false;
+			}
+		} else {
+			for (int i = offset[u]; i < offset[u + 1]; ++i) {
+				if (not Visit(edges[i].label, edges[i].v)) return false;
+			}
+		}
+	}
+	return true;
+}
+
+string FoldedGraph::CanonicalForm() const {
+	vector<int> form;
+	form.push_back(num_vertex);
+	vector<int> id(num_vertex, -1);
+	vector<int> order(1, 0);
+	id[0] = 0;
+	vector<pair<int, int>> adj;
+	for (int i = 0; i < int(order.size()); ++i) {
+		adj.clear();
+		ForEachEdge(order[i], [&adj](int label, int v) {
+			adj.push_back(make_pair(label, v));
+		});
+		sort(adj.begin(), adj.end());
+		for (const pair<int, int>& edge : adj) {
+			if (id[edge.second] == -1) {
+				id[edge.second] = order.size();
+				order.push_back(edge.second);
+			}
+			form.push_back(edge.first);
+			form.push_back(id[edge.second]);
+		}
+		form.push_back(0);  // There are no edges with label 0.
+	}
+	return string(reinterpret_cast<const char*>(form.data()), form.size() * sizeof(int));
 }
 
 } // namespace stallings
@@ -20,6 +20,9 @@
 
 #include <vector>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
 
 namespace stallings {
 
@@ -35,7 +38,7 @@ class Edge {
 	}
 
 	int v, label;
-	void Show() const;
+	void Show(std::ostream& out = std::cout) const;
 };
 
 typedef std::vector<Edge> Path;
@@ -43,6 +46,44 @@ typedef std::vector<Edge> Path;
 typedef std::vector<Edge> Adj;
 typedef std::vector<Adj> AdjList;
 
+// Disjoint sets of the vertices 0..n-1. Find is iterative and halves the path
+// as it goes up, so it does not need any stack even on very long paths.
+class DisjointSet {
+ public:
+	DisjointSet() {}
+	explicit DisjointSet(int n);
+
+	int Find(int u) {
+		while (parent[u] != u) {
+			parent[u] = parent[parent[u]];
+			u = parent[u];
+		}
+		return u;
+	}
+
+	// Join the sets of u and v, the smaller one under the bigger one. Return
+	// false if they were already the same set.
+	bool Union(int u, int v);
+
+	// Put the root v under the root u, whatever their sizes.
+	void Link(int u, int v);
+
+	// For the callers that keep something along the paths to the root: the
+	// parent of u (u for a root), and moving u, in the same set, under 'p'.
+	int Parent(int u) const {
+		return parent[u];
+	}
+	void SetParent(int u, int p) {
+		parent[u] = p;
+	}
+
+ private:
+	std::vector<int> parent;
+	std::vector<int> size;  // Only valid for the roots.
+};
+
+class FoldedGraph;
+
 class Graph {
  public:
 	// Create an empty graph.
@@ -80,6 +121,9 @@ class Graph {
 	void AllShortestPaths(std::vector<Edge>& prev, std::vector<int>& dist) const;
 
 	void ComputeSpanningTree(Graph& st, std::vector<std::tuple<int, int, int>>& not_used) const;
+	// Same, with a breadth first search tree from the root, so the path in the
+	// tree to every node is a shortest one.
+	void ComputeGeodesicTree(Graph& st, std::vector<std::tuple<int, int, int>>& not_used) const;
 
 	void ComputeQuotient(Graph& qt, const std::vector<int>& relation) const;
 
@@ -89,7 +133,7 @@ class Graph {
 	std::vector<std::vector<std::pair<int, int>>> ListEdgesByLabel() const;
 	
 	// Prints the graph.
-	void Show() const;
+	void Show(std::ostream& out = std::cout) const;
 
 	Adj& operator[](int idx) {
 		return list[idx];
@@ -102,7 +146,19 @@ class Graph {
 	// Swap two graphs.
 	static void Swap(Graph& g1, Graph& g2);
 
-	static Graph PullBack(const Graph& gH, const Graph& gK);
+	// Connected component of (0, 0) in the pullback, trimmed. As both graphs are
+	// folded, every pair has at most one neighbour with each label, so only the
+	// pairs reachable from (0, 0) are explored. Vertex 0 is (0, 0).
+	static Graph CorePullBack(const FoldedGraph& gH, const FoldedGraph& gK);
+
+	// Cores of the connected components of the pullback that are not trees.
+	// The root of every component is the pair in 'roots'; the component of
+	// (0, 0), if present, goes first and keeps the hanging tree up to (0, 0).
+	static std::vector<Graph> PullBackComponents(const FoldedGraph& gH,
+			const FoldedGraph& gK, std::vector<std::pair<int, int>>& roots);
+
+	// Pair tables up to this size are indexed directly, otherwise with a hash.
+	const static long long MAX_PAIR_TABLE = 1 << 24;
 
  private:
 	int num_vertex;
@@ -110,6 +166,133 @@ class Graph {
 	AdjList list;
 };
 
+// Frozen copy of a folded graph, used for the queries. As every vertex has at
+// most one edge with each label, when the graph is dense enough the
+// neighbours are stored in a flat num_vertex x (2 * max_label) table (-1 if
+// there is no edge) and following an edge is a single lookup. Otherwise such
+// a table is mostly empty (and slower, as it doesn't fit in cache), so the
+// edges are kept in compressed rows instead.
+class FoldedGraph {
+ public:
+	FoldedGraph() : num_vertex(0), max_label(0), dense(false), offset_data(1, 0) {
+		Point();
+	}
+
+	// 'graph' must be folded.
+	explicit FoldedGraph(const Graph& graph);
+
+	FoldedGraph(const FoldedGraph& g);
+	FoldedGraph(FoldedGraph&& g);
+	FoldedGraph& operator=(const FoldedGraph& g);
+	FoldedGraph& operator=(FoldedGraph&& g);
+
+	// Append the graph to 'out': the number of vertices, the max label, if it
+	// is dense, and then the table, or the offsets and the edges.
+	void Serialize(std::vector<int>& out) const;
+
+	// The graph written by Serialize at 'data', used in place: nothing is
+	// copied, and 'storage' (not null) keeps the memory alive.
+	// Return false if 'size' ints are not the size of such a graph, if an
+	// edge goes out of the graph or has a label out of range, or if the graph
+	// is not folded, or some edge has no reverse.
+	static bool View(const int* data, int size, std::shared_ptr<const void> storage,
+			FoldedGraph& graph);
+
+	int Size() const {
+		return num_vertex;
+	}
+
+	int MaxLabel() const {
+		return max_label;
+	}
+
+	// Return the neighbour of u through the edge with the given label, or -1.
+	int Next(int u, int label) const {
+		if (dense) {
+			if (label > max_label or label < -max_label) return -1;
+			return table[u * 2 * max_label + Column(label)];
+		}
+		for (int i = offset[u]; i < offset[u + 1]; ++i) {
+			if (edges[i].label == label) return edges[i].v;
+		}
+		return -1;
+	}
+
+	bool HasEdge(int u, int label, int& v) const {
+		v = Next(u, label);
+		return v != -1;
+	}
+
+	// True if the edges are stored in the table.
+	bool IsDense() const {
+		return dense;
+	}
+
+	// Hint that the edges of u will be needed soon.
+	void Prefetch(int u) const {
+#ifdef __GNUC__
+		if (dense) __builtin_prefetch(&table[u * 2 * max_label]);
+#endif
+	}
+
+	bool HasExactEdge(int u, int label, int v) const {
+		return v != -1 and Next(u, label) == v;
+	}
+
+	// Call f(label, v) for every edge u --(label)--> v.
+	template <typename F>
+	void ForEachEdge(int u, F f) const {
+		if (dense) {
+			for (int c = 0; c < 2 * max_label; ++c) {
+				int v = table[u * 2 * max_label + c];
+				if (v != -1) f(Label(c), v);
+			}
+		} else {
+			for (int i = offset[u]; i < offset[u + 1]; ++i) f(edges[i].label, edges[i].v);
+		}
+	}
+
+	// Number of edges in u.
+	int Degree(int u) const;
+
+	bool IsIsomorphic(const FoldedGraph& g) const;
+
+	// A string that identifies the graph up to isomorphism (fixing the root).
+	// The vertices are renumbered in the order a breadth first search from the
+	// root finds them, following the edges sorted by label, and the edges of
+	// every vertex are listed in that order. As the graph is folded, two graphs
+	// are isomorphic iff their canonical forms are equal.
+	std::string CanonicalForm() const;
+
+ private:
+	// Labels 1..max_label go first, then -1..-max_label.
+	int Column(int label) const {
+		return label > 0 ? label - 1 : max_label - label - 1;
+	}
+
+	int Label(int column) const {
+		return column < max_label ? column + 1 : max_label - column - 1;
+	}
+
+	// Point table, offset and edges to the vectors of the graph.
+	void Point();
+
+	int num_vertex;
+	int max_label;
+	bool dense;
+
+	// Edges of u are edges[offset[u]..offset[u + 1]). They point to the
+	// vectors below, or to the memory of a View.
+	const int* table;
+	const int* offset;
+	const Edge* edges;
+
+	std::vector<int> table_data;
+	std::vector<int> offset_data;
+	std::vector<Edge> edge_data;
+	std::shared_ptr<const void> storage;  // Only for a View.
+};
+
 }  // namespace stallings
 
 std::ostream& operator<<(std::ostream& out, const stallings::Path& path);
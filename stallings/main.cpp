@@ -15,176 +15,733 @@
 *   along with Stallings-Calculator.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <cache.hpp>
 #include <graph.hpp>
+#include <parallel.hpp>
+#include <parser.hpp>
+#include <storage.hpp>
 #include <subgroup.hpp>
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <mutex>
+#include <queue>
 #include <vector>
 #include <iostream>
 #include <fstream>
+#include <iterator>
 #include <sstream>
 
 using namespace stallings;
 using namespace std;
 
 map<string, Subgroup> sgs;
+// Subgroups are looked up and added under this lock, so that the commands
+// run in parallel (see RunParallel) can do it while others do the same.
+mutex sgs_mutex;
 
-void input(istream&);
+// Set from the command line. Without prompt, the input is a script and the
+// output is only flushed when the buffer is full. With json, every command
+// writes one line with a JSON object: its name, and its results or an error.
+bool prompt = true;
+bool json = false;
+bool parallel = false;
+atomic<int> errors(0);
+// Where the parse errors go, when the output is not JSON. RunParallel gives
+// every command its own buffer, written in order with its output.
+thread_local ostream* parse_errors = &cerr;
 
-void NotDefined(const string& name) {
-	cout << "Subgroup " << name << " is not defined." << endl;
+void input(Parser&, ostream&);
+
+bool IsDefined(const string& name) {
+	lock_guard<mutex> guard(sgs_mutex);
+	return sgs.count(name);
+}
+
+// The subgroup called 'name', defined as the trivial one if it was not.
+Subgroup& Get(const string& name) {
+	lock_guard<mutex> guard(sgs_mutex);
+	return sgs[name];
+}
+
+string JsonString(const string& s) {
+	string quoted = "\"";
+	for (const char c : s) {
+		if (c == '"' or c == '\\') {
+			quoted += '\\';
+			quoted += c;
+		} else if (c == '\n') quoted += "\\n";
+		else if (c == '\t') quoted += "\\t";
+		else if ((unsigned char)c < 0x20) {
+			const char* hex = "0123456789abcdef";
+			quoted += "\\u00";
+			quoted += hex[c >> 4];
+			quoted += hex[c & 15];
+		} else quoted += c;
+	}
+	return quoted + "\"";
+}
+
+// A word in the syntax of the input, "" for the identity.
+string JsonWord(const Element& element) {
+	string s = "\"";
+	for (int i = 0; i < int(element.size()); ++i) {
+		if (i) s += ' ';
+		if (element[i] < 0) s += '-';
+		s += char(abs(element[i]) + 'a' - 1);
+	}
+	return s + "\"";
+}
+
+string JsonWords(const vector<Element>& elements) {
+	string s = "[";
+	for (int i = 0; i < int(elements.size()); ++i) {
+		if (i) s += ',';
+		s += JsonWord(elements[i]);
+	}
+	return s + "]";
 }
 
-void SubgroupCommand(istream& in) {
+string JsonNumbers(const vector<int>& numbers) {
+	string s = "[";
+	for (int i = 0; i < int(numbers.size()); ++i) {
+		if (i) s += ',';
+		s += to_string(numbers[i]);
+	}
+	return s + "]";
+}
+
+// The start of the JSON object of a command, to be followed by its fields.
+string JsonCommand(const string& command) {
+	return "{\"command\":" + JsonString(command);
+}
+
+void Error(ostream& out, const string& command, const string& message) {
+	++errors;
+	if (json) out << JsonCommand(command) << ",\"error\":" << JsonString(message) << "}\n";
+	else out << message << '\n';
+}
+
+// Parse errors go to stderr (see parse_errors), unless the output is JSON.
+void ParseError(ostream& out, const string& command, const string& message) {
+	if (json) Error(out, command, message);
+	else {
+		++errors;
+		*parse_errors << message << endl;
+	}
+}
+
+string NotDefined(const string& name) {
+	return "Subgroup " + name + " is not defined.";
+}
+
+// Report the names that are not defined, only the first one in JSON, where
+// every command has one error. Return true if all of them are.
+bool Defined(ostream& out, const string& command, const vector<string>& names) {
+	bool defined = true;
+	for (const string& name : names) {
+		if (IsDefined(name)) continue;
+		if (defined or not json) Error(out, command, NotDefined(name));
+		defined = false;
+	}
+	return defined;
+}
+
+// The result of a command that defines or shows a subgroup.
+void ShowSubgroup(ostream& out, const string& command, const string& name) {
+	if (json) {
+		out << JsonCommand(command) << ",\"name\":" << JsonString(name);
+		out << ",\"base\":" << JsonWords(Get(name).GetBase()) << "}\n";
+	} else out << name << " = " << Get(name) << '\n';
+}
+
+void SubgroupCommand(Parser& in, ostream& out) {
 	string name;
 	int n;
-	in >> name >> n;
+	if (not in.Token(name) or not in.Number(n)) {
+		ParseError(out, "subgroup", in.Error());
+		return;
+	}
 	vector<Element> base(n);
-	for (Element& ele : base) in >> ele;
-	sgs[name] = Subgroup(base);
-	cout << name << " = " << sgs[name] << endl;
+	for (Element& ele : base) {
+		if (not in.Word(ele)) {
+			ParseError(out, "subgroup", in.Error());
+			return;
+		}
+	}
+	Get(name) = Subgroup(base);
+	ShowSubgroup(out, "subgroup", name);
 }
 
-void MemberCommand(istream& in) {
-	string list;
-	getline(in, list);
+void MemberCommand(Parser& in, ostream& out) {
+	string list = in.RestOfLine();
 	Element element;
-	in >> element;
+	if (not in.Word(element)) {
+		ParseError(out, "member", in.Error());
+		return;
+	}
+	if (json) out << JsonCommand("member") << ",\"element\":" << JsonWord(element) << ",\"results\":[";
 	stringstream ss(list);
 	string name;
+	bool first = true;
 	while (ss >> name) {
-		if (sgs.count(name)) {
-			Subgroup& sg = sgs[name];
+		if (json) {
+			if (not first) out << ',';
+			first = false;
+			out << "{\"subgroup\":" << JsonString(name);
+			if (IsDefined(name)) {
+				Subgroup& sg = Get(name);
+				if (sg.Contains(element)) {
+					out << ",\"member\":true,\"coordinates\":" << JsonNumbers(sg.GetCoordinates(element));
+				} else out << ",\"member\":false";
+			} else out << ",\"error\":" << JsonString(NotDefined(name));
+			out << '}';
+		} else if (IsDefined(name)) {
+			Subgroup& sg = Get(name);
 			if (sg.Contains(element)) {
-				cout << "(" << element << ")" << " is a member of " << name << endl;
+				out << "(" << element << ")" << " is a member of " << name << '\n';
 				vector<int> comb = sg.GetCoordinates(element);
 				Element p;
 				for (const int c : comb) {
 					Element ele = sg.GetBaseElement(c);
-					cout << "(" << ele << ")";
-					p = Subgroup::Product(p, ele);
+					out << "(" << ele << ")";
+					Subgroup::ProductInto(p, ele, p);
 				}
-				cout << endl << "Product: " << p << endl;
-			} else cout << "(" << element << ")" << " is NOT a member of " << name << endl;
-		} else NotDefined(name);
+				out << '\n' << "Product: " << p << '\n';
+			} else out << "(" << element << ")" << " is NOT a member of " << name << '\n';
+		} else Error(out, "member", NotDefined(name));
 	}
+	if (json) out << "]}\n";
 }
 
-void IntersectionCommand(istream& in) {
+void MemberBatchCommand(Parser& in, ostream& out) {
+	string list = in.RestOfLine();
+	string file;
+	in.Token(file);
+	MappedFile mapped;
+	if (not mapped.Open(file)) {
+		Error(out, "memberbatch", "Cannot open file");
+		return;
+	}
+	// One element per line.
+	Parser batch(mapped.Data(), mapped.Data() + mapped.Size());
+	vector<Element> elements;
+	while (not batch.AtEnd()) {
+		elements.push_back(Element());
+		if (not batch.Word(elements.back())) {
+			ParseError(out, "memberbatch", json ? batch.Error() : file + ": " + batch.Error());
+			return;
+		}
+	}
+
+	if (json) out << JsonCommand("memberbatch") << ",\"elements\":" << elements.size() << ",\"results\":[";
+	stringstream ss(list);
+	string name;
+	bool first = true;
+	while (ss >> name) {
+		if (json) {
+			if (not first) out << ',';
+			first = false;
+			out << "{\"subgroup\":" << JsonString(name);
+		}
+		if (IsDefined(name)) {
+			vector<bool> member = Get(name).ContainsBatch(elements);
+			string bits(member.size(), '0');
+			for (int i = 0; i < int(member.size()); ++i) if (member[i]) bits[i] = '1';
+			int members = count(bits.begin(), bits.end(), '1');
+			if (json) out << ",\"members\":" << members << ",\"bits\":\"" << bits << '"';
+			else {
+				out << members << " of " << elements.size();
+				out << " elements are members of " << name << '\n';
+				out << bits << '\n';
+			}
+		} else if (json) out << ",\"error\":" << JsonString(NotDefined(name));
+		else Error(out, "memberbatch", NotDefined(name));
+		if (json) out << '}';
+	}
+	if (json) out << "]}\n";
+}
+
+void IntersectionCommand(Parser& in, ostream& out) {
 	string name1, name2, name3;
-	in >> name1 >> name2 >> name3;
-	if (sgs.count(name1) and sgs.count(name2)) {
-		Subgroup inter = Subgroup::Intersection(sgs[name1], sgs[name2]);
-		sgs[name3] = inter;
-		cout << name3 << " = " << sgs[name3] << endl;
-	} else {
-		if (sgs.count(name1) == 0) NotDefined(name1);
-		if (sgs.count(name2) == 0) NotDefined(name2);
+	in.Token(name1);
+	in.Token(name2);
+	in.Token(name3);
+	if (Defined(out, "intersection", {name1, name2})) {
+		Subgroup inter = Subgroup::Intersection(Get(name1), Get(name2));
+		Get(name3) = inter;
+		ShowSubgroup(out, "intersection", name3);
+	}
+}
+
+void NIntersectionCommand(Parser& in, ostream& out) {
+	// The last name is the result.
+	string list = in.RestOfLine(), name;
+	stringstream ss(list);
+	vector<string> names;
+	while (ss >> name) names.push_back(name);
+	if (names.size() < 2) {
+		Error(out, "nintersection", "Usage: nintersection A B ... result");
+		return;
 	}
+	string result = names.back();
+	names.pop_back();
+	if (not Defined(out, "nintersection", names)) return;
+	vector<Subgroup> operands;
+	for (const string& n : names) operands.push_back(Get(n));
+	Get(result) = Subgroup::Intersection(operands);
+	ShowSubgroup(out, "nintersection", result);
 }
 
-void IndexCommand(istream& in) {
+void IntersectionsCommand(Parser& in, ostream& out) {
+	string name1, name2;
+	in.Token(name1);
+	in.Token(name2);
+	if (Defined(out, "intersections", {name1, name2})) {
+		vector<pair<Element, Subgroup>> components = Subgroup::IntersectionComponents(Get(name1), Get(name2));
+		if (json) {
+			out << JsonCommand("intersections") << ",\"components\":[";
+			for (int i = 0; i < int(components.size()); ++i) {
+				if (i) out << ',';
+				out << "{\"g\":" << JsonWord(components[i].first);
+				out << ",\"base\":" << JsonWords(components[i].second.GetBase()) << '}';
+			}
+			out << "]}\n";
+			return;
+		}
+		out << "Non-trivial intersections " << name1 << " ^ g " << name2 << " g^-1: ";
+		out << components.size() << '\n';
+		for (const pair<Element, Subgroup>& c : components) {
+			out << "g = " << c.first << '\n';
+			out << c.second << '\n';
+		}
+	}
+}
+
+void IndexCommand(Parser& in, ostream& out) {
 	string name;
-	in >> name;
-	if (sgs.count(name)) {
-		Subgroup& sg = sgs[name];
+	in.Token(name);
+	if (Defined(out, "index", {name})) {
+		Subgroup& sg = Get(name);
 		int index = sg.Index();
-		cout << "Subgroup " << name << " has index: ";
-		if (index == Subgroup::INFINIT_INDEX) cout << "Infinite" << endl;
+		if (json) {
+			out << JsonCommand("index") << ",\"name\":" << JsonString(name);
+			if (index == Subgroup::INFINIT_INDEX) out << ",\"index\":null}\n";
+			else out << ",\"index\":" << index << ",\"cosets\":" << JsonWords(sg.GetCosets()) << "}\n";
+			return;
+		}
+		out << "Subgroup " << name << " has index: ";
+		if (index == Subgroup::INFINIT_INDEX) out << "Infinite" << '\n';
 		else {
-			cout << index << endl;
+			out << index << '\n';
 			vector<Element> repr = sg.GetCosets();
-			for (const Element& ele : repr) cout << '(' << ele << ')' << endl;
+			for (const Element& ele : repr) out << '(' << ele << ')' << '\n';
 		}
-	} else NotDefined(name);
+	}
 }
 
-void GraphCommand(istream& in) {
+void GraphCommand(Parser& in, ostream& out) {
 	string name;
-	in >> name;
-	if (sgs.count(name)) {
-		cout << "Graph of subgroup " << name << endl;
-		Subgroup& sg = sgs[name];
-		sg.ShowStallingsGraph();
-	} else NotDefined(name);
+	in.Token(name);
+	if (Defined(out, "graph", {name})) {
+		Subgroup& sg = Get(name);
+		if (json) {
+			// Every edge once, with its positive label: [u, label, v].
+			const Graph& graph = sg.GetStallingsGraph();
+			out << JsonCommand("graph") << ",\"name\":" << JsonString(name);
+			out << ",\"vertices\":" << graph.Size() << ",\"edges\":[";
+			bool first = true;
+			for (int u = 0; u < graph.Size(); ++u) {
+				for (const Edge& edge : graph.const_list(u)) {
+					if (edge.label < 0) continue;
+					if (not first) out << ',';
+					first = false;
+					out << '[' << u << ',' << edge.label << ',' << edge.v << ']';
+				}
+			}
+			out << "]}\n";
+			return;
+		}
+		out << "Graph of subgroup " << name << '\n';
+		sg.ShowStallingsGraph(out);
+	}
+}
+
+// The subgroups found by fringe and algext.
+void Subgroups(ostream& out, const string& command, const string& name,
+		const vector<Subgroup>& subgroups) {
+	if (json) {
+		out << JsonCommand(command) << ",\"name\":" << JsonString(name) << ",\"subgroups\":[";
+		for (int i = 0; i < int(subgroups.size()); ++i) {
+			if (i) out << ',';
+			out << JsonWords(subgroups[i].GetBase());
+		}
+		out << "]}\n";
+	} else for (const Subgroup& sg : subgroups) out << sg << '\n';
 }
 
-void FringeCommand(istream& in) {
+void FringeCommand(Parser& in, ostream& out) {
 	string name;
-	in >> name;
-	if (sgs.count(name)) {
-		cout << "Fringe of subgroup " << name << endl;
-		Subgroup& sg = sgs[name];
-		vector<Subgroup> fringe = sg.GetFringe();
-		for (const Subgroup& fsg : fringe) cout << fsg << endl;
-	} else NotDefined(name);
+	in.Token(name);
+	if (Defined(out, "fringe", {name})) {
+		if (not json) out << "Fringe of subgroup " << name << '\n';
+		Subgroups(out, "fringe", name, Get(name).GetFringe());
+	}
 }
 
-void AlgextCommand(istream& in) {
+void AlgextCommand(Parser& in, ostream& out) {
 	string name;
-	in >> name;
-	if (sgs.count(name)) {
-		cout << "Algebraic extensions of subgroup " << name << endl;
-		Subgroup& sg = sgs[name];
-		vector<Subgroup> ae = sg.GetAlgebraicExtensions();
-		for (const Subgroup& aesg : ae) cout << aesg << endl;
-	} else NotDefined(name);
+	in.Token(name);
+	if (Defined(out, "algext", {name})) {
+		if (not json) out << "Algebraic extensions of subgroup " << name << '\n';
+		Subgroups(out, "algext", name, Get(name).GetAlgebraicExtensions());
+	}
 }
 
-void ImportCommand(istream& in) {
+void ImportCommand(Parser& in, ostream& out) {
 	string file;
-	in >> file;
-	ifstream fin(file);
-	if (not fin.good()) {
-		cout << "Cannot open file" << endl;
+	in.Token(file);
+	MappedFile mapped;
+	if (not mapped.Open(file)) {
+		Error(out, "import", "Cannot open file");
+		return;
+	}
+	// The output of the script is discarded.
+	Parser script(mapped.Data(), mapped.Data() + mapped.Size());
+	ostream discard(nullptr);
+	input(script, discard);
+	if (json) out << JsonCommand("import") << ",\"file\":" << JsonString(file) << "}\n";
+	else out << "Import succesful" << '\n';
+}
+
+void SaveCommand(Parser& in, ostream& out) {
+	// save <file> [coordinates]
+	string line = in.RestOfLine(), file, option;
+	stringstream ss(line);
+	ss >> file >> option;
+	if (file.empty() or not (option.empty() or option == "coordinates")) {
+		Error(out, "save", "Usage: save <file> [coordinates]");
+		return;
+	}
+	if (not Storage::Save(file, sgs, option == "coordinates")) {
+		Error(out, "save", "Cannot write file");
 		return;
 	}
-	cout.setstate(ios_base::failbit);
-	input(fin);
-	cout.clear();
-	fin.close();
-	cout << "Import succesful" << endl;
+	if (json) {
+		out << JsonCommand("save") << ",\"file\":" << JsonString(file);
+		out << ",\"subgroups\":" << sgs.size() << "}\n";
+	} else out << "Saved " << sgs.size() << " subgroups" << '\n';
 }
 
-void ListCommand(istream& in) {
+void LoadCommand(Parser& in, ostream& out) {
+	string file;
+	in.Token(file);
+	map<string, Subgroup> loaded;
+	if (not Storage::Load(file, loaded)) {
+		Error(out, "load", "Cannot load file");
+		return;
+	}
+	for (pair<const string, Subgroup>& p : loaded) Get(p.first) = move(p.second);
+	if (json) {
+		out << JsonCommand("load") << ",\"file\":" << JsonString(file);
+		out << ",\"subgroups\":" << loaded.size() << "}\n";
+	} else out << "Loaded " << loaded.size() << " subgroups" << '\n';
+}
+
+void ListCommand(Parser& in, ostream& out) {
+	if (json) out << JsonCommand("list") << ",\"subgroups\":[";
+	bool first = true;
 	for (const pair<string, Subgroup>& p : sgs) {
-		cout << endl << p.first << " = " << p.second << endl;
+		if (json) {
+			if (not first) out << ',';
+			first = false;
+			out << "{\"name\":" << JsonString(p.first) << ",\"base\":" << JsonWords(p.second.GetBase()) << '}';
+		} else out << '\n' << p.first << " = " << p.second << '\n';
 	}
+	if (json) out << "]}\n";
 }
 
-void ClearCommand(istream& in) {
+void ClearCommand(Parser& in, ostream& out) {
 	sgs.clear();
+	if (json) out << JsonCommand("clear") << "}\n";
 }
 
-void ShowCommand(istream& in) {
+void CacheCommand(Parser& in, ostream& out) {
+	// cache [clear | limit <bytes>]
+	string line = in.RestOfLine(), option;
+	stringstream ss(line);
+	if (ss >> option) {
+		string usage;
+		if (option == "clear") ResultCache::Clear();
+		else if (option == "limit") {
+			size_t bytes;
+			if (ss >> bytes) ResultCache::SetLimit(bytes);
+			else usage = "Usage: cache limit <bytes>";
+		} else usage = "Usage: cache [clear | limit <bytes>]";
+		if (not usage.empty()) {
+			Error(out, "cache", usage);
+			if (json) return;
+		}
+	}
+	if (json) {
+		out << JsonCommand("cache") << ",\"results\":" << ResultCache::Size();
+		out << ",\"bytes\":" << ResultCache::Bytes() << ",\"limit\":" << ResultCache::Limit();
+		out << ",\"operations\":[";
+		for (int i = 0; i < ResultCache::NUM_OPERATIONS; ++i) {
+			ResultCache::Operation op = ResultCache::Operation(i);
+			if (i) out << ',';
+			out << "{\"operation\":" << JsonString(ResultCache::Name(op));
+			out << ",\"hits\":" << ResultCache::Hits(op) << ",\"misses\":" << ResultCache::Misses(op) << '}';
+		}
+		out << "]}\n";
+		return;
+	}
+	out << "Cached results: " << ResultCache::Size() << ", " << ResultCache::Bytes();
+	out << " bytes of " << ResultCache::Limit() << '\n';
+	for (int i = 0; i < ResultCache::NUM_OPERATIONS; ++i) {
+		ResultCache::Operation op = ResultCache::Operation(i);
+		out << ResultCache::Name(op) << ": " << ResultCache::Hits(op) << " hits, ";
+		out << ResultCache::Misses(op) << " misses" << '\n';
+	}
+}
+
+void ShowCommand(Parser& in, ostream& out) {
 	string name;
-	in >> name;
-	if (sgs.count(name)) {
-		cout << name << " = " << sgs[name] << endl;
-	} else NotDefined(name);
+	in.Token(name);
+	if (Defined(out, "show", {name})) ShowSubgroup(out, "show", name);
+}
+
+// Run the command 's', reading its arguments from 'in'. Return false for exit.
+bool RunCommand(const string& s, Parser& in, ostream& out) {
+	if (s == "subgroup") SubgroupCommand(in, out);
+	else if (s == "member") MemberCommand(in, out);
+	else if (s == "memberbatch") MemberBatchCommand(in, out);
+	else if (s == "intersection") IntersectionCommand(in, out);
+	else if (s == "nintersection") NIntersectionCommand(in, out);
+	else if (s == "intersections") IntersectionsCommand(in, out);
+	else if (s == "index") IndexCommand(in, out);
+	else if (s == "graph") GraphCommand(in, out);
+	else if (s == "fringe") FringeCommand(in, out);
+	else if (s == "algext") AlgextCommand(in, out);
+	else if (s == "import") ImportCommand(in, out);
+	else if (s == "save") SaveCommand(in, out);
+	else if (s == "load") LoadCommand(in, out);
+	else if (s == "list") ListCommand(in, out);
+	else if (s == "clear") ClearCommand(in, out);
+	else if (s == "show") ShowCommand(in, out);
+	else if (s == "cache") CacheCommand(in, out);
+	else if (s == "exit") return false;
+	else Error(out, s, s + ": unknown command");
+	return true;
 }
 
-void input(istream& in) {
+void input(Parser& in, ostream& out) {
 	string s;
-	cout << "#> ";
-	while (in >> s) {
-		if (s == "subgroup") SubgroupCommand(in);
-		else if (s == "member") MemberCommand(in);
-		else if (s == "intersection") IntersectionCommand(in);
-		else if (s == "index") IndexCommand(in);
-		else if (s == "graph") GraphCommand(in);
-		else if (s == "fringe") FringeCommand(in);
-		else if (s == "algext") AlgextCommand(in);
-		else if (s == "import") ImportCommand(in);
-		else if (s == "list") ListCommand(in);
-		else if (s == "clear") ClearCommand(in);
-		else if (s == "show") ShowCommand(in);
-		else if (s == "exit") break;
-		else cout << s << ": unknown command" << endl;
-		cout << endl << "#> ";
-	}
-}
-
-int main() {
-	input(cin);
+	if (prompt) out << "#> " << flush;
+	while (in.Token(s) and RunCommand(s, in, out)) {
+		if (prompt) out << '\n' << "#> " << flush;
+		else if (not json) out << '\n';
+	}
+}
+
+// A command of a script run in parallel, with a copy of the parser where its
+// arguments start, and the subgroups it uses.
+struct Command {
+	Command(const string& name_, const Parser& args_) : name(name_), args(args_), barrier(false) {}
+
+	string name;
+	Parser args;
+	vector<string> uses;
+	bool barrier;  // It uses every subgroup, or something else shared.
+	string error;  // The parse error, if any. The command is not run.
+};
+
+// Read the arguments of the command like it does, to find the subgroups it
+// uses. Return false on a parse error.
+bool Scan(Parser& in, Command& c) {
+	string name;
+	Element element;
+	if (c.name == "subgroup") {
+		int n;
+		if (not in.Token(name) or not in.Number(n)) return false;
+		c.uses.push_back(name);
+		for (int i = 0; i < n; ++i) if (not in.Word(element)) return false;
+	} else if (c.name == "member" or c.name == "memberbatch" or c.name == "nintersection") {
+		stringstream ss(in.RestOfLine());
+		while (ss >> name) c.uses.push_back(name);
+		if (c.name == "member") return in.Word(element);
+		if (c.name == "memberbatch") in.Token(name);
+	} else if (c.name == "intersection" or c.name == "intersections") {
+		int names = c.name == "intersection" ? 3 : 2;
+		for (int i = 0; i < names; ++i) {
+			in.Token(name);
+			c.uses.push_back(name);
+		}
+	} else if (c.name == "index" or c.name == "graph" or c.name == "fringe" or c.name == "algext"
+			or c.name == "show") {
+		in.Token(name);
+		c.uses.push_back(name);
+	} else if (c.name == "import" or c.name == "load") {
+		in.Token(name);
+		c.barrier = true;
+	} else if (c.name == "save" or c.name == "cache") {
+		in.RestOfLine();
+		c.barrier = true;
+	} else if (c.name == "list" or c.name == "clear") c.barrier = true;
+	return true;
+}
+
+// Read the whole script, and run its commands in Parallel::NumThreads()
+// threads. A command waits for the previous ones that use any of its
+// subgroups, even just to read them, since the queries compute and keep
+// parts of the subgroup on first use. The output is the same as input's,
+// written in the order of the script as the commands are done.
+void RunParallel(Parser& in, ostream& out) {
+	vector<Command> commands;
+	string s;
+	while (in.Token(s) and s != "exit") {
+		commands.push_back(Command(s, in));
+		if (not Scan(in, commands.back())) commands.back().error = in.Error();
+	}
+
+	int n = commands.size();
+	vector<int> waiting(n, 0);  // Commands to wait for.
+	vector<vector<int>> next(n);  // Commands that wait for this one.
+	map<string, int> last_use;
+	vector<int> since_barrier;
+	int last_barrier = -1;
+	for (int i = 0; i < n; ++i) {
+		vector<int> after;
+		if (last_barrier >= 0) after.push_back(last_barrier);
+		if (commands[i].barrier) {
+			after.insert(after.end(), since_barrier.begin(), since_barrier.end());
+			since_barrier.clear();
+			last_use.clear();
+			last_barrier = i;
+		} else {
+			for (const string& name : commands[i].uses) {
+				auto it = last_use.find(name);
+				if (it != last_use.end() and it->second != i) after.push_back(it->second);
+				last_use[name] = i;
+			}
+			since_barrier.push_back(i);
+		}
+		sort(after.begin(), after.end());
+		after.erase(unique(after.begin(), after.end()), after.end());
+		waiting[i] = after.size();
+		for (const int j : after) next[j].push_back(i);
+	}
+
+	mutex m;
+	condition_variable changed;
+	priority_queue<int, vector<int>, greater<int>> ready;  // The first ones first.
+	for (int i = 0; i < n; ++i) if (waiting[i] == 0) ready.push(i);
+	vector<string> output(n), error_output(n);
+	vector<bool> done(n, false);
+	int finished = 0, written = 0;
+	Parallel::ForEach(Parallel::NumThreads(), [&](int) {
+		unique_lock<mutex> lock(m);
+		while (true) {
+			changed.wait(lock, [&]() { return not ready.empty() or finished == n; });
+			if (ready.empty()) return;
+			int i = ready.top();
+			ready.pop();
+			lock.unlock();
+
+			Command& c = commands[i];
+			ostringstream text, error_text;
+			parse_errors = &error_text;
+			if (c.error.empty()) RunCommand(c.name, c.args, text);
+			parse_errors = &cerr;
+			if (not json) text << '\n';
+
+			lock.lock();
+			output[i] = text.str();
+			error_output[i] = error_text.str();
+			done[i] = true;
+			++finished;
+			for (const int j : next[i]) if (--waiting[j] == 0) ready.push(j);
+			for (; written < n and done[written]; ++written) {
+				// Parse errors may go to stderr, they are also kept in order.
+				const Command& w = commands[written];
+				if (not w.error.empty()) ParseError(out, w.name, w.error);
+				cerr << error_output[written];
+				out << output[written];
+				string().swap(output[written]);
+				string().swap(error_output[written]);
+			}
+			changed.notify_all();
+		}
+	});
+}
+
+void Usage() {
+	cerr << "Usage: stallings [--batch] [--json] [--parallel] [--input FILE] [--output FILE]" << endl;
+	cerr << "                 [--threads N]" << endl;
+	cerr << "Without options, an interactive prompt. A batch run reads the commands" << endl;
+	cerr << "from FILE or stdin and writes their results to FILE or stdout, without" << endl;
+	cerr << "prompts; --json writes one JSON object per command. With --parallel, the" << endl;
+	cerr << "commands on different subgroups run at the same time, in N threads, and" << endl;
+	cerr << "their results are written in order. The exit status is 1 if some command" << endl;
+	cerr << "failed, and 2 if the options or the files are wrong." << endl;
+}
+
+int main(int argc, char* argv[]) {
+	string input_file, output_file;
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if (arg == "--batch") prompt = false;
+		else if (arg == "--json") json = true;
+		else if (arg == "--parallel") parallel = true;
+		else if ((arg == "--input" or arg == "-i") and has_value) input_file = argv[++i];
+		else if ((arg == "--output" or arg == "-o") and has_value) output_file = argv[++i];
+		else if ((arg == "--threads" or arg == "-t") and has_value) {
+			int threads = atoi(argv[++i]);
+			if (threads < 1) {
+				Usage();
+				return 2;
+			}
+			Parallel::SetNumThreads(threads);
+		} else {
+			Usage();
+			return 2;
+		}
+	}
+	if (json or parallel or not input_file.empty() or not output_file.empty()) prompt = false;
+	if (not prompt) ios_base::sync_with_stdio(false);
+
+	ofstream fout;
+	if (not output_file.empty()) {
+		fout.open(output_file);
+		if (not fout.good()) {
+			cerr << "Cannot write " << output_file << endl;
+			return 2;
+		}
+	}
+	ostream& out = output_file.empty() ? cout : fout;
+
+	if (input_file.empty() and parallel) {
+		// The whole script is needed first.
+		string script((istreambuf_iterator<char>(cin)), istreambuf_iterator<char>());
+		Parser in(script.data(), script.data() + script.size());
+		RunParallel(in, out);
+	} else if (input_file.empty()) {
+		Parser in(cin);
+		input(in, out);
+	} else {
+		MappedFile file;
+		if (not file.Open(input_file)) {
+			cerr << "Cannot open " << input_file << endl;
+			return 2;
+		}
+		Parser in(file.Data(), file.Data() + file.Size());
+		if (parallel) RunParallel(in, out);
+		else input(in, out);
+	}
+	out.flush();
+	if (not out.good()) return 2;
+	return prompt or errors == 0 ? 0 : 1;
 }
@@ -0,0 +1,73 @@
+/*
+*   This file is part of Stallings-Calculator.
+*
+*   Stallings-Calculator is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   NSMB Editor 5 is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with Stallings-Calculator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <parallel.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace stallings {
+
+int Parallel::num_threads = 0;
+
+int Parallel::NumThreads() {
+	if (num_threads > 0) return num_threads;
+	// Asking the system takes a few microseconds, too much for small tasks.
+	static const int cores = max(1, int(thread::hardware_concurrency()));
+	return cores;
+}
+
+void Parallel::SetNumThreads(int n) {
+	num_threads = n;
+}
+
+void Parallel::For(int n, int grain, const function<void(int, int)>& f) {
+	int blocks = min(NumThreads(), max(1, n / max(1, grain)));
+	if (blocks <= 1) {
+		f(0, n);
+		return;
+	}
+	vector<thread> threads;
+	for (int b = 1; b < blocks; ++b) {
+		threads.push_back(thread(f, int((long long)n * b / blocks),
+				int((long long)n * (b + 1) / blocks)));
+	}
+	f(0, int((long long)n / blocks));
+	for (thread& t : threads) t.join();
+}
+
+void Parallel::ForEach(int n, const function<void(int)>& f) {
+	int workers = min(NumThreads(), n);
+	if (workers <= 1) {
+		for (int i = 0; i < n; ++i) f(i);
+		return;
+	}
+	atomic<int> next(0);
+	auto work = [n, &f, &next]() {
+		for (int i = next++; i < n; i = next++) f(i);
+	};
+	vector<thread> threads;
+	for (int w = 1; w < workers; ++w) threads.push_back(thread(work));
+	work();
+	for (thread& t : threads) t.join();
+}
+
+}  // namespace stallings
@@ -0,0 +1,46 @@
+/*
+*   This file is part of Stallings-Calculator.
+*
+*   Stallings-Calculator is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   NSMB Editor 5 is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with Stallings-Calculator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <functional>
+
+namespace stallings {
+
+class Parallel {
+ public:
+	// Number of threads used by the parallel algorithms. By default, one per core.
+	static int NumThreads();
+	static void SetNumThreads(int n);
+
+	// Split [0, n) in contiguous blocks and call f(begin, end) for each block,
+	// one thread per block. Blocks smaller than 'grain' are not worth a thread.
+	static void For(int n, int grain, const std::function<void(int, int)>& f);
+
+	// Call f(i) for every i in [0, n). The threads take the next index from a
+	// shared counter as soon as they are done, so the tasks may take very
+	// different times. Each index is run exactly once, in no particular order.
+	static void ForEach(int n, const std::function<void(int)>& f);
+
+ private:
+	static int num_threads;
+};
+
+}  // namespace stallings
+
+#endif // PARALLEL_HPP
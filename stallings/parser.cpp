@@ -0,0 +1,174 @@
+/*
+*   This file is part of Stallings-Calculator.
+*
+*   Stallings-Calculator is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   NSMB Editor 5 is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with Stallings-Calculator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <parser.hpp>
+
+#include <cstring>
+
+using namespace std;
+
+namespace stallings {
+
+const int Parser::MAX_EXPONENT;
+
+namespace {
+
+bool IsBlank(char c) {
+	return c == ' ' or c == '\t' or c == '\r' or c == '\v' or c == '\f';
+}
+
+bool IsDigit(char c) {
+	return '0' <= c and c <= '9';
+}
+
+}  // namespace
+
+Parser::Parser(const char* begin, const char* end_)
+		: in(nullptr), next(begin), end(end_), line_begin(begin), pos(begin), line_end(begin),
+		line(0) {}
+
+Parser::Parser(istream& in_)
+		: in(&in_), next(nullptr), end(nullptr), line_begin(nullptr), pos(nullptr), line_end(nullptr),
+		line(0) {}
+
+bool Parser::NextLine() {
+	if (in) {
+		if (not getline(*in, buffer)) return false;
+		line_begin = buffer.data();
+		line_end = line_begin + buffer.size();
+	} else {
+		if (next == end) return false;
+		line_begin = next;
+		line_end = static_cast<const char*>(memchr(next, '\n', end - next));
+		if (line_end) next = line_end + 1;
+		else next = line_end = end;
+	}
+	pos = line_begin;
+	++line;
+	return true;
+}
+
+bool Parser::Skip(bool lines) {
+	while (true) {
+		while (pos < line_end and IsBlank(*pos)) ++pos;
+		if (pos < line_end) return true;
+		if (not lines or not NextLine()) return false;
+	}
+}
+
+void Parser::SetError(const char* at, const string& message) {
+	error = "line " + to_string(line) + ", column " + to_string(at - line_begin + 1) + ": " + message;
+}
+
+bool Parser::Token(string& token) {
+	if (not Skip(true)) {
+		SetError(pos, "unexpected end of input");
+		return false;
+	}
+	const char* begin = pos;
+	while (pos < line_end and not IsBlank(*pos)) ++pos;
+	token.assign(begin, pos);
+	return true;
+}
+
+bool Parser::Number(int& n) {
+	if (not Skip(true)) {
+		SetError(pos, "unexpected end of input");
+		return false;
+	}
+	const char* begin = pos;
+	n = 0;
+	while (pos < line_end and IsDigit(*pos)) {
+		n = 10 * n + int(*pos++ - '0');
+		if (n > MAX_EXPONENT) {
+			SetError(begin, "number too large");
+			pos = line_end;
+			return false;
+		}
+	}
+	if (pos == begin or (pos < line_end and not IsBlank(*pos))) {
+		SetError(pos, "expected a number");
+		pos = line_end;
+		return false;
+	}
+	return true;
+}
+
+string Parser::RestOfLine() {
+	string rest(pos, line_end);
+	pos = line_end;
+	return rest;
+}
+
+bool Parser::AtEnd() {
+	return not Skip(true);
+}
+
+bool Parser::Word(vector<int>& word) {
+	word.clear();
+	if (not Skip(true)) {
+		SetError(pos, "unexpected end of input");
+		return false;
+	}
+	const char* at;
+	const char* message;
+	bool ok = ParseWord(pos, line_end, word, at, message);
+	if (not ok) SetError(at, message);
+	pos = line_end;
+	return ok;
+}
+
+bool Parser::ParseWord(const char* begin, const char* end, vector<int>& word,
+		const char*& at, const char*& message) {
+	const char* p = begin;
+	while (true) {
+		while (p < end and IsBlank(*p)) ++p;
+		if (p == end) return true;
+		int sign = 1;
+		if (*p == '-') {
+			sign = -1;
+			++p;
+		}
+		int exponent = 1;
+		if (p < end and IsDigit(*p)) {
+			const char* digits = p;
+			exponent = 0;
+			while (p < end and IsDigit(*p)) {
+				exponent = 10 * exponent + int(*p++ - '0');
+				if (exponent > MAX_EXPONENT) {
+					at = digits;
+					message = "exponent too large";
+					return false;
+				}
+			}
+		}
+		if (p == end or *p < 'a' or *p > 'z') {
+			at = p;
+			message = "expected a letter";
+			return false;
+		}
+		int letter = sign * int(*p++ - 'a' + 1);
+		if (p < end and not IsBlank(*p)) {
+			at = p;
+			message = "expected a blank after the letter";
+			return false;
+		}
+		word.insert(word.end(), exponent, letter);
+	}
+}
+
+}  // namespace stallings
@@ -0,0 +1,91 @@
+/*
+*   This file is part of Stallings-Calculator.
+*
+*   Stallings-Calculator is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   NSMB Editor 5 is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with Stallings-Calculator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PARSER_HPP
+#define PARSER_HPP
+
+#include <istream>
+#include <string>
+#include <vector>
+
+namespace stallings {
+
+// Reads commands and words from a memory buffer (like a MappedFile) in place,
+// or from a stream one line at a time, as it is needed, for interactive input.
+// A word is written on one line as factors separated by blanks: a letter,
+// optionally after an exponent and a sign, so "3a -b -2c" is a a a -b -c -c.
+// Errors are reported with their line and column instead of stopping.
+class Parser {
+ public:
+	// Parse [begin, end), which must stay alive while the parser is used.
+	Parser(const char* begin, const char* end);
+	explicit Parser(std::istream& in);
+
+	// The next run of non blank characters, going to the next lines if needed.
+	// Return false at the end of the input (an error for a command that needs
+	// more).
+	bool Token(std::string& token);
+
+	// The next token as a non negative number. Return false if it is not one.
+	bool Number(int& n);
+
+	// Whether only blanks are left.
+	bool AtEnd();
+
+	// The rest of the current line, which is left.
+	std::string RestOfLine();
+
+	// The word in the rest of the current line or, if it is blank, in the next
+	// line that is not. On error, or at the end of the input, return false and
+	// leave the line.
+	bool Word(std::vector<int>& word);
+
+	// The last error, as "line L, column C: message".
+	const std::string& Error() const {
+		return error;
+	}
+
+	// Decode the factors in [begin, end) and append them to 'word'. On error,
+	// return false with 'at' pointing to the wrong character and 'message'.
+	static bool ParseWord(const char* begin, const char* end, std::vector<int>& word,
+			const char*& at, const char*& message);
+
+	// Exponents are at most this, so that a typo does not exhaust the memory.
+	const static int MAX_EXPONENT = 1 << 24;
+
+ private:
+	// Skip blanks in the current line, and lines if 'lines'. Return false if
+	// nothing is left.
+	bool Skip(bool lines);
+	// Go to the next line. Return false at the end of the input.
+	bool NextLine();
+	void SetError(const char* at, const std::string& message);
+
+	std::istream* in;
+	std::string buffer;  // The current line, when reading a stream.
+	const char* next;  // The lines after the current one, in a memory buffer.
+	const char* end;
+	const char* line_begin;
+	const char* pos;
+	const char* line_end;
+	int line;
+	std::string error;
+};
+
+}  // namespace stallings
+
+#endif // PARSER_HPP
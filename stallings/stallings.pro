@@ -7,16 +7,27 @@ SOURCES += main.cpp \
     graph.cpp \
     subgroup.cpp \
     folding.cpp \
-    whitehead.cpp
+    whitehead.cpp \
+    parallel.cpp \
+    word.cpp \
+    cache.cpp \
+    storage.cpp \
+    parser.cpp
 
 HEADERS += \
     subgroup.hpp \
     graph.hpp \
     folding.hpp \
     ../whitehead.hpp \
-    whitehead.hpp
+    whitehead.hpp \
+    parallel.hpp \
+    word.hpp \
+    cache.hpp \
+    storage.hpp \
+    parser.hpp
 
 OTHER_FILES += \
     ../assets/test.in
 
-QMAKE_CXXFLAGS += -std=c++11
+QMAKE_CXXFLAGS += -std=c++11 -pthread
+LIBS += -pthread
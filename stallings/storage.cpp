@@ -0,0 +1,152 @@
+/*
+*   This file is part of Stallings-Calculator.
+*
+*   Stallings-Calculator is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   NSMB Editor 5 is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with Stallings-Calculator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <storage.hpp>
+
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define STALLINGS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace stallings {
+
+const int Storage::MAGIC;
+const int Storage::VERSION;
+
+#ifdef STALLINGS_MMAP
+namespace {
+
+// A file mapped in memory, unmapped when the last user of it is gone.
+class Mapping {
+ public:
+	Mapping(void* data_, size_t size_) : data(data_), size(size_) {}
+	~Mapping() {
+		munmap(data, size);
+	}
+
+	void* data;
+	size_t size;
+};
+
+}  // namespace
+#endif
+
+bool MappedFile::Open(const string& path) {
+	data = nullptr;
+	size = 0;
+	handle.reset();
+#ifdef STALLINGS_MMAP
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return false;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return true;
+	}
+	void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) return false;
+	handle = make_shared<Mapping>(mapped, st.st_size);
+	data = static_cast<const char*>(mapped);
+	size = st.st_size;
+	return true;
+#else
+	ifstream in(path, ios::binary | ios::ate);
+	if (not in.good()) return false;
+	size_t bytes = in.tellg();
+	// Ints, so that the contents are aligned for Storage::Load.
+	auto contents = make_shared<vector<int>>((bytes + sizeof(int) - 1) / sizeof(int));
+	in.seekg(0);
+	in.read(reinterpret_cast<char*>(contents->data()), bytes);
+	if (not in.good()) return false;
+	handle = contents;
+	data = reinterpret_cast<const char*>(contents->data());
+	size = bytes;
+	return true;
+#endif
+}
+
+bool Storage::Save(const string& path, const map<string, Subgroup>& subgroups,
+		bool with_coordinates) {
+	vector<int> out;
+	out.push_back(MAGIC);
+	out.push_back(VERSION);
+	out.push_back(subgroups.size());
+	for (const pair<const string, Subgroup>& p : subgroups) {
+		const string& name = p.first;
+		out.push_back((name.size() + sizeof(int) - 1) / sizeof(int) + 1);
+		out.push_back(name.size());
+		int at = out.size();
+		out.resize(out.size() + (name.size() + sizeof(int) - 1) / sizeof(int));
+		if (not name.empty()) memcpy(&out[at], name.data(), name.size());
+
+		at = out.size();
+		out.push_back(0);
+		p.second.Serialize(out, with_coordinates);
+		out[at] = out.size() - at - 1;
+	}
+	ofstream fout(path, ios::binary);
+	fout.write(reinterpret_cast<const char*>(out.data()), out.size() * sizeof(int));
+	return fout.good();
+}
+
+bool Storage::Load(const string& path, map<string, Subgroup>& subgroups) {
+	MappedFile file;
+	if (not file.Open(path)) return false;
+	const int* data = reinterpret_cast<const int*>(file.Data());
+	size_t size = file.Size() / sizeof(int);
+	const shared_ptr<const void>& storage = file.Handle();
+	if (size < 3 or data[0] != MAGIC or data[1] != VERSION or data[2] < 0) return false;
+
+	int count = data[2];
+	const int* end = data + size;
+	data += 3;
+	vector<pair<string, Subgroup>> loaded;
+	for (int i = 0; i < count; ++i) {
+		// The name, then the record.
+		if (end - data < 2 or data[0] < 1 or data[0] > end - data - 1) return false;
+		int length = data[1];
+		if (length < 0 or (long long)length > (long long)(data[0] - 1) * int(sizeof(int))) return false;
+		string name(reinterpret_cast<const char*>(data + 2), length);
+		data += 1 + data[0];
+
+		if (end - data < 1 or data[0] < 0 or data[0] > end - data - 1) return false;
+		Subgroup sg;
+		if (not Subgroup::View(data + 1, data[0], storage, sg)) return false;
+		loaded.push_back(make_pair(name, move(sg)));
+		data += 1 + data[0];
+	}
+	if (data != end) return false;
+	for (pair<string, Subgroup>& p : loaded) subgroups[p.first] = move(p.second);
+	return true;
+}
+
+}  // namespace stallings
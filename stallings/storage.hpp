@@ -0,0 +1,79 @@
+/*
+*   This file is part of Stallings-Calculator.
+*
+*   Stallings-Calculator is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   NSMB Editor 5 is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with Stallings-Calculator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STORAGE_HPP
+#define STORAGE_HPP
+
+#include <subgroup.hpp>
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <string>
+
+namespace stallings {
+
+// The contents of a file, mapped in memory where the system allows it and
+// read into a buffer otherwise. Copies share the contents, which stay alive
+// while a copy or the Handle() is kept.
+class MappedFile {
+ public:
+	MappedFile() : data(nullptr), size(0) {}
+
+	// Return false if the file cannot be read. An empty file has no Data().
+	bool Open(const std::string& path);
+
+	const char* Data() const {
+		return data;
+	}
+	size_t Size() const {
+		return size;
+	}
+	const std::shared_ptr<const void>& Handle() const {
+		return handle;
+	}
+
+ private:
+	const char* data;
+	size_t size;
+	std::shared_ptr<const void> handle;
+};
+
+// Subgroups saved in a binary file, to load a catalog without parsing and
+// folding it again. The file is an array of ints: the magic number, the
+// version and the number of subgroups, and then every subgroup with its name
+// (its length in bytes, and the bytes) and its record (see
+// Subgroup::Serialize), each after its size. The ints are in the byte order
+// of the machine, a file from another one is rejected by the magic number.
+class Storage {
+ public:
+	// Return false if the file cannot be written.
+	static bool Save(const std::string& path, const std::map<std::string, Subgroup>& subgroups,
+			bool with_coordinates);
+
+	// Map the file in memory, where the subgroups read their graphs in place,
+	// and add them to 'subgroups'. Return false if the file cannot be read or
+	// is not valid, leaving 'subgroups' untouched.
+	static bool Load(const std::string& path, std::map<std::string, Subgroup>& subgroups);
+
+	const static int MAGIC = 0x534c5453;  // "STLS"
+	const static int VERSION = 2;
+};
+
+}  // namespace stallings
+
+#endif // STORAGE_HPP
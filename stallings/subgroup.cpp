@@ -16,8 +16,12 @@
 */
 
 #include <subgroup.hpp>
+#include <cache.hpp>
+#include <parallel.hpp>
+#include <parser.hpp>
 #include <whitehead.hpp>
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cassert>
@@ -25,30 +29,233 @@
 #include <stack>
 #include <functional>
 #include <queue>
+#include <unordered_map>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
 namespace stallings {
 
-Subgroup::Subgroup() : has_base(false), is_folded(false) {
-	stallings_graph = Graph(1);  // Base vertex.
+namespace {
+
+// Enumerates the partitions of the vertices of a folded graph that are closed
+// under folding: if u ~ v and both have an edge with the same label, their
+// ends are also in the same block. The vertices are decided in order, each one
+// either joins a previous block or opens a new one that must stay apart from
+// the previous ones. The merges forced by folding are propagated right away,
+// and undone when backtracking.
+class CongruenceSearch {
+ public:
+	explicit CongruenceSearch(const Graph& graph) : n(graph.Size()),
+			columns(2 * graph.MaxLabel()), parent(n), size(n, 1), low(n),
+			out(n * columns, -1), blocks(n) {
+		for (int u = 0; u < n; ++u) {
+			parent[u] = low[u] = u;
+			for (const Edge& edge : graph.const_list(u)) out[u * columns + Column(edge.label)] = edge.v;
+		}
+	}
+
+	// Calls f(choices) for every closed partition, in the lexicographic order
+	// of their restricted growth strings, where choices are the decisions taken
+	// for the vertices that were not forced. Only the partitions whose choices
+	// start with 'prefix' are visited. If max_choices >= 0, the search stops at
+	// that many choices and calls f with the partial choices instead.
+	void Run(const vector<int>& prefix, int max_choices,
+			const function<void(const vector<int>&)>& f) {
+		vector<int> choices;
+		Search(0, prefix, max_choices, choices, f);
+	}
+
+	// The block of every vertex in the last partition found, numbered in order
+	// of their first vertex.
+	const vector<int>& Blocks() const {
+		return blocks;
+	}
+
+ private:
+	int Column(int label) const {
+		return label > 0 ? label - 1 : columns / 2 - label - 1;
+	}
+
+	int Find(int u) const {
+		while (parent[u] != u) u = parent[u];
+		return u;
+	}
+
+	void Set(int& x, int value) {
+		history.push_back(make_pair(&x, x));
+		x = value;
+	}
+
+	void Rollback(int mark) {
+		while (int(history.size()) > mark) {
+			*history.back().first = history.back().second;
+			history.pop_back();
+		}
+	}
+
+	// Merges the blocks of u and v and everything it forces. Fails if two
+	// blocks with vertices before i would be merged.
+	bool Merge(int u, int v, int i) {
+		vector<pair<int, int>> pending(1, make_pair(u, v));
+		while (not pending.empty()) {
+			int a = Find(pending.back().first);
+			int b = Find(pending.back().second);
+			pending.pop_back();
+			if (a == b) continue;
+			if (low[a] < i and low[b] < i) return false;
+			if (size[a] < size[b]) swap(a, b);
+			Set(parent[b], a);
+			Set(size[a], size[a] + size[b]);
+			Set(low[a], min(low[a], low[b]));
+			for (int c = 0; c < columns; ++c) {
+				int w = out[b * columns + c];
+				if (w == -1) continue;
+				int& x = out[a * columns + c];
+				if (x == -1) Set(x, w);
+				else pending.push_back(make_pair(x, w));
+			}
+		}
+		return true;
+	}
+
+	void Search(int i, const vector<int>& prefix, int max_choices,
+			vector<int>& choices, const function<void(const vector<int>&)>& f) {
+		// Skip the vertices already merged with a previous one.
+		while (i < n and low[Find(i)] < i) ++i;
+		if (i == n or int(choices.size()) == max_choices) {
+			if (i == n) {
+				vector<int> index(n, -1);
+				for (int k = 0; k < int(opened.size()); ++k) index[Find(opened[k])] = k;
+				for (int u = 0; u < n; ++u) blocks[u] = index[Find(u)];
+			}
+			f(choices);
+			return;
+		}
+		int first = 0, last = opened.size();
+		if (choices.size() < prefix.size()) first = last = prefix[choices.size()];
+		for (int k = first; k <= last; ++k) {
+			choices.push_back(k);
+			int mark = history.size();
+			if (k < int(opened.size())) {
+				if (Merge(i, opened[k], i)) Search(i + 1, prefix, max_choices, choices, f);
+			} else {
+				opened.push_back(i);
+				Search(i + 1, prefix, max_choices, choices, f);
+				opened.pop_back();
+			}
+			Rollback(mark);
+			choices.pop_back();
+		}
+	}
+
+	int n, columns;
+	vector<int> parent, size, low;  // Union-find, without path compression.
+	vector<int> out;  // Edges of every block, 'columns' per vertex.
+	vector<pair<int*, int>> history;  // Values overwritten, to roll back.
+	vector<int> opened;  // First vertex of every block, in order.
+	vector<int> blocks;
+};
+
+// The subgroups are kept in the cache by their bases.
+vector<vector<Element>> Bases(const vector<Subgroup>& subgroups) {
+	vector<vector<Element>> bases;
+	for (const Subgroup& sg : subgroups) bases.push_back(sg.GetBase());
+	return bases;
 }
 
-Subgroup::Subgroup(const vector<Element>& base_) : base(base_),
-		has_base(true), is_folded(false){
-	stallings_graph = Graph(1);  // Base vertex.
-	for (const Element& element : base) {
-		AddElement(element, stallings_graph);
+vector<Subgroup> FromBases(const vector<vector<Element>>& bases) {
+	vector<Subgroup> subgroups;
+	for (const vector<Element>& base : bases) subgroups.push_back(Subgroup(base));
+	return subgroups;
+}
+
+string PairKey(const Subgroup& a, const Subgroup& b) {
+	return to_string(a.CanonicalForm().size()) + ":" + a.CanonicalForm() + b.CanonicalForm();
+}
+
+}  // namespace
+
+Subgroup::Subgroup() : base_tree(ANY_TREE), has_transitions(false), has_fold_history(false),
+		has_coordinates(false), has_base(false), is_folded(false), stored_base(nullptr),
+		stored_base_size(0), stored_coordinates(nullptr), stored_coordinates_size(0) {
+}
+
+Subgroup::Subgroup(const vector<Element>& base_) : base_tree(ANY_TREE), base(base_),
+		has_transitions(false), has_fold_history(false), has_coordinates(false), has_base(true),
+		is_folded(false), stored_base(nullptr), stored_base_size(0), stored_coordinates(nullptr),
+		stored_coordinates_size(0) {
+}
+
+Subgroup::Subgroup(const Graph& graph, BaseTree tree) : base_tree(tree), given_graph(graph),
+		has_transitions(false), has_fold_history(false), has_coordinates(false), has_base(false),
+		is_folded(false), stored_base(nullptr), stored_base_size(0), stored_coordinates(nullptr),
+		stored_coordinates_size(0) {
+}
+
+namespace {
+
+// Read the elements written one after the other, each after its length, in
+// [data, end), into 'elements'. They must have been checked by CheckElements.
+void ReadElements(const int* data, const int* end, vector<Element>& elements) {
+	while (data < end) {
+		int length = *data++;
+		elements.push_back(Element(data, data + length));
+		data += length;
 	}
+}
 
-	Fold();
+// Check the elements that ReadElements would read in [data, end): every one
+// ends before 'end', and its letters are in [-max_letter, max_letter] but 0.
+// Count them, and the vertices that AddElement adds for them.
+bool CheckElements(const int* data, const int* end, int max_letter, int& count,
+		long long& vertices) {
+	count = 0;
+	vertices = 0;
+	while (data < end) {
+		int length = *data++;
+		if (length < 0 or length > end - data) return false;
+		for (int i = 0; i < length; ++i) {
+			if (data[i] == 0 or data[i] > max_letter or data[i] < -max_letter) return false;
+		}
+		++count;
+		vertices += max(length - 1, 0);
+		data += length;
+	}
+	return true;
+}
+
+void WriteElement(const Element& element, vector<int>& out) {
+	out.push_back(element.size());
+	out.insert(out.end(), element.begin(), element.end());
 }
 
-Subgroup::Subgroup(const Graph& graph) : has_base(true), is_folded(false) {
+}  // namespace
+
+void Subgroup::ComputeBase() const {
+	if (has_base) return;
+	lock_guard<recursive_mutex> lock(lazy.mutex);
+	if (has_base) return;
+	if (stored_base != nullptr) {
+		// Fold reads it, as it may have to take another one.
+		Fold();
+		return;
+	}
+	if (given_graph.Size() == 0) return;
+	base = GraphBase(given_graph, base_tree);
+	given_graph = Graph();
+	has_base = true;
+}
+
+vector<Element> Subgroup::GraphBase(const Graph& graph, BaseTree tree) {
 	// Compute spanning tree
 	vector<tuple<int, int, int>> not_used;
 	Graph st;
-	graph.ComputeSpanningTree(st, not_used);
+	if (tree == GEODESIC_TREE) graph.ComputeGeodesicTree(st, not_used);
+	else graph.ComputeSpanningTree(st, not_used);
 
 	// Shortest path from every node to the root
 	vector<Edge> prev;
@@ -65,32 +272,34 @@ Subgroup::Subgroup(const Graph& graph) : has_base(true), is_folded(false) {
 		}
 	}
 
-	// Build graph by closing the cycles.
-	stallings_graph = Graph(1);
+	// The base closes the cycles.
+	vector<Element> base;
 	for (auto& t : not_used) {
 		int u, v, label;
 		tie(u, v, label) = t;
-		Element b = Product(Product(Inverse(path[u]), Element(1, label)), path[v]);
-		AddElement(b, stallings_graph);
+		Element b;
+		InverseInto(path[u], b);
+		b.push_back(label);
+		ProductInto(b, path[v], b);
 		base.push_back(move(b));
 	}
-
-	Fold();
+	return base;
 }
 
 void Subgroup::ShowFoldings() const {
-	if (not is_folded) cout << "The graph is not folded." << endl;
-	for (const Folding& fold : foldings) fold.Show();
+	Fold();
+	GetFoldHistory().Replay([](const Folding& fold) { fold.Show(); });
 }
 
-void Subgroup::ShowStallingsGraph() const {
-	if (not is_folded) cout << "The graph is not folded." << endl;
-	cout << "------------- Stallings Graph -------------" << endl;
-	stallings_graph.Show();
-	cout << "-------------------------------------------" << endl;
+void Subgroup::ShowStallingsGraph(ostream& out) const {
+	Fold();
+	out << "------------- Stallings Graph -------------\n";
+	stallings_graph.Show(out);
+	out << "-------------------------------------------\n";
 }
 
 void Subgroup::ShowBase() const {
+	ComputeBase();
 	if (not has_base) cout << "The subgroup base is not computed yet." << endl;
 	else {
 		cout << "------------- Subgroup's base -------------" << endl;
@@ -101,10 +310,12 @@ void Subgroup::ShowBase() const {
 }
 
 int Subgroup::GetBaseSize() const {
+	ComputeBase();
 	return base.size();
 }
 
 Element Subgroup::GetBaseElement(int idx) const {
+	ComputeBase();
 	assert((idx > 0 and idx <= int(base.size())) or (idx < 0 and idx >= -int(base.size())));
 	if (idx > 0) return base[idx - 1];
 	return Inverse(base[-idx - 1]);
@@ -126,135 +337,413 @@ void Subgroup::AddElement(const Element& element, Graph& graph) {
 	}
 }
 
-void Subgroup::Fold() {
+void Subgroup::Fold() const {
+	if (is_folded) return;
+	lock_guard<recursive_mutex> lock(lazy.mutex);
 	if (is_folded) return;
 
-	// Get coordinates
-	coordinates.clear();
-	for (int i = 0; i < int(stallings_graph[0].size()); ++i) {
-		coordinates[stallings_graph[0][i]] = (i % 2 == 0 ? i / 2 + 1 : - i / 2 - 1);
-	}
+	if (stored_base != nullptr) ReadElements(stored_base, stored_base + stored_base_size, base);
+	else ComputeBase();
+	auto FoldBase = [this]() {
+		unfolded_graph = Graph(1);  // Base vertex.
+		for (const Element& element : base) {
+			AddElement(element, unfolded_graph);
+		}
 
-	// Do foldings
-	Folding fold;
-	while (stallings_graph.FindRepeatedEdge(fold.u, fold.v, fold.w, fold.label)) {
-		DoFolding(fold);
+		// Fold everything at once.
+		Folder folder(unfolded_graph);
+		stallings_graph = folder.Fold();
+		unfolded_map = folder.VertexMap();
+	};
+	FoldBase();
+	if (has_transitions and stallings_graph.Size() != transitions.Size()) {
+		// The base of a View goes through every edge of its graph, so its
+		// fold goes onto the graph, but it has more vertices: the base
+		// generates less. The graph is the one saved, take a base from it.
+		Graph graph(transitions.Size());
+		for (int u = 0; u < graph.Size(); ++u) {
+			transitions.ForEachEdge(u, [&graph, u](int label, int v) {
+				graph.AddSingleEdge(u, v, label);
+			});
+		}
+		base = GraphBase(graph, base_tree);
+		stored_coordinates = nullptr;
+		FoldBase();
+	}
+	if (stored_base != nullptr) has_base = true;
+	// The transitions of a View are already there, and may be in use.
+	if (not has_transitions) {
+		transitions = FoldedGraph(stallings_graph);
+		has_transitions = true;
 	}
 	is_folded = true;
 }
 
-void Subgroup::DoFolding(Folding& fold) {
-	Graph::Swap(fold.graph, stallings_graph);
-	Graph& oldgraph = fold.graph;
-	
-	if (fold.v == fold.w) {
-		// Copy the whole graph without one edge u-w
-		stallings_graph = Graph(oldgraph.Size());
-		bool skip = false, skiprev = false;
-		for (int i = 0; i < oldgraph.Size(); ++i) {
-			for (const Edge& edge : oldgraph[i]) {
-				if (skip or i != fold.u or edge.v != fold.w or edge.label != fold.label) {
-					if (skiprev or i != fold.w or edge.v != fold.u or edge.label != -fold.label) {
-						stallings_graph.AddSingleEdge(i, edge.v, edge.label);
-					} else {
-						skiprev = true;
-					}
-				} else {
-					skip = true;
-				}
+void Subgroup::ComputeTransitions() const {
+	if (not has_transitions) Fold();
+}
+
+const string& Subgroup::CanonicalForm() const {
+	ComputeTransitions();
+	if (not has_canonical_form) {
+		lock_guard<recursive_mutex> lock(lazy.mutex);
+		if (not has_canonical_form) {
+			canonical_form = transitions.CanonicalForm();
+			has_canonical_form = true;
+		}
+	}
+	return canonical_form;
+}
+
+void Subgroup::Serialize(vector<int>& out, bool with_coordinates) const {
+	Fold();
+	if (with_coordinates) ComputeCoordinates();
+	// Every section goes after its size, so that View finds them without
+	// reading them.
+	auto Section = [&out](const function<void()>& write) {
+		int at = out.size();
+		out.push_back(0);
+		write();
+		out[at] = out.size() - at - 1;
+	};
+	Section([this, &out]() {
+		for (const Element& element : base) WriteElement(element, out);
+	});
+	Section([this, &out]() {
+		transitions.Serialize(out);
+	});
+	Section([this, &out, with_coordinates]() {
+		if (not with_coordinates) return;
+		for (const Element& word : vertex_coordinates) WriteElement(word, out);
+	});
+}
+
+bool Subgroup::View(const int* data, int size, shared_ptr<const void> storage, Subgroup& sg) {
+	const int* section[3];
+	int length[3];
+	for (int i = 0; i < 3; ++i) {
+		if (size < 1 or data[0] < 0 or data[0] > size - 1) return false;
+		length[i] = data[0];
+		section[i] = data + 1;
+		data += 1 + length[i];
+		size -= 1 + length[i];
+	}
+	if (size != 0) return false;
+
+	Subgroup view;
+	if (not FoldedGraph::View(section[1], length[1], storage, view.transitions)) return false;
+	// The base and the coordinates are read on first use, but checked now.
+	// There is a word for every vertex of the petals of the base, and the
+	// base vertex.
+	int base_size, num_words;
+	long long vertices, unused;
+	if (not CheckElements(section[0], section[0] + length[0], view.transitions.MaxLabel(),
+			base_size, vertices)) {
+		return false;
+	}
+	// The queries that use the base fold it again, so it must generate the
+	// subgroup of the graph: every element goes around from the base vertex,
+	// and together they go through every edge.
+	// The edges are numbered by their end with the positive label. A dense
+	// graph has a table that big already, otherwise they are sorted.
+	const FoldedGraph& graph = view.transitions;
+	long long max_label = graph.MaxLabel();
+	vector<bool> seen(graph.IsDense() ? graph.Size() * max_label : 0, false);
+	vector<long long> covered;
+	long long num_edges = 0;
+	for (const int* element = section[0]; element < section[0] + length[0];
+			element += 1 + *element) {
+		int u = 0;
+		for (int i = 1; i <= *element; ++i) {
+			int label = element[i];
+			int v = graph.Next(u, label);
+			if (v == -1) return false;
+			long long edge = label > 0 ? u * max_label + label - 1 : v * max_label - label - 1;
+			if (not graph.IsDense()) covered.push_back(edge);
+			else if (not seen[edge]) {
+				seen[edge] = true;
+				++num_edges;
 			}
+			u = v;
+		}
+		if (u != 0) return false;
+	}
+	if (not graph.IsDense()) {
+		sort(covered.begin(), covered.end());
+		num_edges = unique(covered.begin(), covered.end()) - covered.begin();
+	}
+	for (int u = 0; u < graph.Size(); ++u) {
+		graph.ForEachEdge(u, [&num_edges](int label, int) {
+			if (label > 0) --num_edges;
+		});
+	}
+	if (num_edges != 0) return false;
+	if (length[2] > 0 and (not CheckElements(section[2], section[2] + length[2], base_size,
+			num_words, unused) or num_words != vertices + 1)) {
+		return false;
+	}
+	view.has_transitions = true;
+	view.storage = storage;
+	view.stored_base = section[0];
+	view.stored_base_size = length[0];
+	if (length[2] > 0) {
+		view.stored_coordinates = section[2];
+		view.stored_coordinates_size = length[2];
+	}
+	sg = move(view);
+	return true;
+}
+
+const FoldHistory& Subgroup::GetFoldHistory() const {
+	if (not has_fold_history) {
+		Fold();
+		lock_guard<recursive_mutex> lock(lazy.mutex);
+		if (not has_fold_history) {
+			fold_history = FoldHistory(unfolded_graph);
+			has_fold_history = true;
 		}
-		assert(skip and skiprev);
+	}
+	return fold_history;
+}
+
+void Subgroup::ComputeCoordinates() const {
+	if (has_coordinates) return;
+	Fold();
+	lock_guard<recursive_mutex> lock(lazy.mutex);
+	if (has_coordinates) return;
+	int n = unfolded_graph.Size();
+	if (stored_coordinates != nullptr) {
+		// Saved in the order of the vertices, which folding the same base gives
+		// again.
+		ReadElements(stored_coordinates, stored_coordinates + stored_coordinates_size,
+				vertex_coordinates);
 	} else {
-		// Ensure fold.v < fold.w. As we'll merge them both into fold.v, if one of
-		// them is the 0, the result will still be 0.
-		if (fold.v > fold.w) swap(fold.v, fold.w);
-		bool skip = false, skiprev = false;
-		stallings_graph = Graph(oldgraph.Size() - 1);
-		for (int i = 0; i < oldgraph.Size(); ++i) {
-			int ni = i;
-			if (ni == fold.w) ni = fold.v;
-			else if (ni > fold.w) --ni;
-			for (const Edge& edge : oldgraph[i]) {
-				int nv = edge.v;
-				if (nv == fold.w) nv = fold.v;
-				else if (nv > fold.w) --nv;
-				if (skip or i != fold.u or edge.v != fold.w or edge.label != fold.label) {
-					if (skiprev or i != fold.w or edge.v != fold.u or edge.label != -fold.label) {
-						stallings_graph.AddSingleEdge(ni, nv, edge.label);
-					} else {
-						skiprev = true;
-					}
-				} else {
-					skip = true;
-				}
-			}
+		// The first edge of every petal is its base element. The classes of a
+		// Folder do not depend on the words, they are the same vertices.
+		Folder folder(unfolded_graph);
+		for (int i = 0; i < int(unfolded_graph[0].size()); i += 2) {
+			folder.SetEdgeWord(0, i, Element(1, i / 2 + 1));
 		}
-		assert(skip and skiprev);
+		folder.Fold();
+		vertex_coordinates = folder.VertexWords();
+	}
+
+	const Adj& base_adj = unfolded_graph.const_list(0);
+	int max_label = 0;
+	for (const Edge& edge : base_adj) max_label = max(max_label, abs(edge.label));
+	base_edges.assign(2 * max_label + 1, vector<int>());
+	for (int i = 0; i < int(base_adj.size()); ++i) base_edges[base_adj[i].label + max_label].push_back(i);
+	first_edge_word.assign(n, 0);
+	for (int i = 0; i < int(base_adj.size()); i += 2) {
+		if (base_adj[i].v != 0) first_edge_word[base_adj[i].v] = -(i / 2 + 1);
 	}
-	foldings.push_back(move(fold));
+
+	edge_sources.assign(stallings_graph.Size(), vector<vector<int>>());
+	for (int u = 0; u < stallings_graph.Size(); ++u) {
+		edge_sources[u].resize(stallings_graph.const_list(u).size());
+	}
+	for (int p = 0; p < n; ++p) {
+		const Adj& adj = stallings_graph.const_list(unfolded_map[p]);
+		for (const Edge& edge : unfolded_graph.const_list(p)) {
+			int i = 0;
+			while (adj[i].label != edge.label) ++i;
+			vector<int>& sources = edge_sources[unfolded_map[p]][i];
+			if (sources.empty() or sources.back() != p) sources.push_back(p);
+		}
+	}
+	for (vector<vector<int>>& sources : edge_sources) {
+		for (vector<int>& vertices : sources) {
+			stable_sort(vertices.begin(), vertices.end(), [this](int p, int q) {
+				return vertex_coordinates[p].size() < vertex_coordinates[q].size();
+			});
+			if (int(vertices.size()) > COORDINATE_SOURCES) vertices.resize(COORDINATE_SOURCES);
+		}
+	}
+	has_coordinates = true;
+}
+
+int Subgroup::UnfoldedEdgeWord(int u, int i) const {
+	if (u != 0) return i == 0 ? first_edge_word[u] : 0;
+	if (i % 2 == 0) return i / 2 + 1;
+	// The reverse of the last edge, which is the first one in a petal of one
+	// letter.
+	return unfolded_graph.const_list(0)[i].v == 0 ? -(i / 2 + 1) : 0;
+}
+
+void Subgroup::DoFolding(Graph& graph, Folding& fold) {
+	fold.Apply(graph);
 }
 
 bool Subgroup::Contains(const Element& element) const {
+	ComputeTransitions();
 	int node = 0;
 	for (const int& factor : element) {
-		int v;
-		if (stallings_graph.HasEdge(node, factor, v)) {
-			node = v;
-		}
-		else return false;
+		node = transitions.Next(node, factor);
+		if (node == -1) return false;
 	}
 	return node == 0;
 }
 
+vector<bool> Subgroup::ContainsBatch(const vector<Element>& elements) const {
+	ComputeTransitions();  // Before the threads share it.
+	vector<char> member(elements.size(), false);
+	Parallel::For(elements.size(), BATCH_GRAIN, [this, &elements, &member](int begin, int end) {
+		// Interleaving only pays off with the table. Walking the compressed rows
+		// of a sparse graph is already cache friendly, and faster one by one.
+		if (not transitions.IsDense()) {
+			for (int i = begin; i < end; ++i) member[i] = Contains(elements[i]);
+			return;
+		}
+		// Every lane walks one element; 'pos' is the next letter and 'last' the end.
+		int current[BATCH_LANES], node[BATCH_LANES];
+		const int* pos[BATCH_LANES];
+		const int* last[BATCH_LANES];
+		int next = begin, running = 0;
+		auto Start = [&](int l) {
+			if (next == end) {
+				current[l] = -1;
+				return false;
+			}
+			current[l] = next++;
+			node[l] = 0;
+			pos[l] = elements[current[l]].data();
+			last[l] = pos[l] + elements[current[l]].size();
+			return true;
+		};
+		for (int l = 0; l < BATCH_LANES; ++l) running += Start(l);
+		while (running > 0) {
+			for (int l = 0; l < BATCH_LANES; ++l) {
+				if (current[l] == -1) continue;
+				if (node[l] == -1 or pos[l] == last[l]) {
+					member[current[l]] = (node[l] == 0);
+					if (not Start(l)) --running;
+					continue;
+				}
+				node[l] = transitions.Next(node[l], *pos[l]++);
+				if (node[l] != -1) transitions.Prefetch(node[l]);
+			}
+		}
+	});
+	return vector<bool>(member.begin(), member.end());
+}
+
 Path Subgroup::GetPath(const Element& element) const {
+	ComputeTransitions();
 	Path path;
 	int node = 0;
 	for (const int& factor : element) {
-		int v;
-		assert(stallings_graph.HasEdge(node, factor, v));
-		node = v;
-		path.push_back(Edge(v, factor));
+		node = transitions.Next(node, factor);
+		assert(node != -1);
+		path.push_back(Edge(node, factor));
 	}
 	return path;
 }
 
 vector<int> Subgroup::GetCoordinates(const Element& element) const {
-	Path path = GetPath(element);
-	for (int i = int(foldings.size()) - 1; i >= 0; --i) {
-		//cout << path << endl;
-		path = foldings[i].RaisePath(path);
+	// Lift the path of the element to unfolded_graph, where it follows the
+	// petals and goes from a vertex to another one of its class through the
+	// root, with the words of both. Of the lifts that only go around to the
+	// edge_sources, take the one with the fewest letters in its words, letter
+	// by letter. The coordinates are the product of those words.
+	ComputeCoordinates();
+
+	// The cheapest lift of every prefix to every vertex where one ends: its
+	// cost, the lift of the previous prefix that it continues, and the edge
+	// taken, from 'source' (where that lift ends, unless it goes around).
+	struct Lift {
+		int vertex, cost, back, source, edge;
+	};
+	vector<Lift> lifts(1, Lift{0, 0, -1, 0, -1});
+	unordered_map<int, int> slot;  // The lift to every vertex, for this prefix.
+	int max_label = base_edges.size() / 2;
+	auto Step = [&](int back, int source, int cost, int label) {
+		auto Take = [&](int i) {
+			int v = unfolded_graph.const_list(source)[i].v;
+			Lift lift{v, cost + (UnfoldedEdgeWord(source, i) != 0), back, source, i};
+			auto it = slot.find(v);
+			if (it == slot.end()) {
+				slot[v] = lifts.size();
+				lifts.push_back(lift);
+			} else if (lift.cost < lifts[it->second].cost) lifts[it->second] = lift;
+		};
+		if (source == 0) {
+			if (abs(label) > max_label) return;
+			for (int i : base_edges[label + max_label]) Take(i);
+			return;
+		}
+		const Adj& adj = unfolded_graph.const_list(source);
+		for (int i = 0; i < int(adj.size()); ++i) {
+			if (adj[i].label == label) Take(i);
+		}
+	};
+	auto AroundCost = [this, &lifts](int k) {
+		return lifts[k].cost + int(vertex_coordinates[lifts[k].vertex].size());
+	};
+	int begin = 0, u = 0;
+	for (int label : element) {
+		int end = lifts.size();
+		int around = begin;
+		for (int k = begin; k < end; ++k) {
+			Step(k, lifts[k].vertex, lifts[k].cost, label);
+			if (AroundCost(k) < AroundCost(around)) around = k;
+		}
+		const Adj& adj = stallings_graph.const_list(u);
+		int i = 0;
+		while (adj[i].label != label) ++i;
+		for (int q : edge_sources[u][i]) {
+			Step(around, q, AroundCost(around) + vertex_coordinates[q].size(), label);
+		}
+		slot.clear();
+		begin = end;
+		u = adj[i].v;
+	}
+	assert(u == 0);
+	int last = begin;
+	for (int k = begin; k < int(lifts.size()); ++k) {
+		if (AroundCost(k) < AroundCost(last)) last = k;
 	}
-	//cout << "Final path: " << path << endl;
 
+	vector<int> steps;
+	for (int k = last; k > 0; k = lifts[k].back) steps.push_back(k);
 	vector<int> res;
-	int pos = 0;
-	for (int i = 0; i < int(path.size()); ++i) {
-		if (pos == 0) {
-			auto it = coordinates.find(path[i]);
-			assert(it != coordinates.end());
-			res.push_back(it->second);
+	auto Append = [&res](int c) {
+		if (not res.empty() and res.back() == -c) res.pop_back();
+		else res.push_back(c);
+	};
+	auto ToRoot = [&Append](const Element& word) {
+		for (int k = int(word.size()) - 1; k >= 0; --k) Append(-word[k]);
+	};
+	int p = 0;
+	for (int k = int(steps.size()) - 1; k >= 0; --k) {
+		const Lift& lift = lifts[steps[k]];
+		if (lift.source != p) {
+			ToRoot(vertex_coordinates[p]);
+			for (int c : vertex_coordinates[lift.source]) Append(c);
 		}
-		pos = path[i].v;
+		int c = UnfoldedEdgeWord(lift.source, lift.edge);
+		if (c != 0) Append(c);
+		p = lift.vertex;
 	}
+	ToRoot(vertex_coordinates[p]);
 	return res;
 }
 
 int Subgroup::Index(int rank) const {
-	assert(is_folded);
-	for (int i = 0; i < stallings_graph.Size(); ++i) {
-		if (int(stallings_graph.const_list(i).size()) != 2 * rank) return INFINIT_INDEX;
+	ComputeTransitions();
+	for (int i = 0; i < transitions.Size(); ++i) {
+		if (transitions.Degree(i) != 2 * rank) return INFINIT_INDEX;
 	}
-	return stallings_graph.Size();
+	return transitions.Size();
 }
 
 int Subgroup::Index() const {
-	return Index(stallings_graph.MaxLabel());
+	ComputeTransitions();
+	return Index(transitions.MaxLabel());
 }
 
 vector<Element> Subgroup::GetCosets() const {
 	assert(Index() != INFINIT_INDEX);
-	assert(is_folded);
+	Fold();
 	vector<Edge> prev;
 	vector<int> dist;
 	stallings_graph.AllShortestPaths(prev, dist);
@@ -271,67 +760,126 @@ vector<Element> Subgroup::GetCosets() const {
 }
 
 vector<Subgroup> Subgroup::GetFringe() const {
-	vector<Subgroup> result;
-	vector<int> ss(stallings_graph.Size());
+	ResultCache::Result cached;
+	if (ResultCache::Find(ResultCache::FRINGE, CanonicalForm(), cached)) return FromBases(cached.bases);
+	vector<Subgroup> fringe = ComputeFringe();
+	cached.bases = Bases(fringe);
+	ResultCache::Store(ResultCache::FRINGE, CanonicalForm(), cached);
+	return fringe;
+}
 
-	function<void(int,int)> Backtracking = [this, &Backtracking, &ss, &result](int i, int subsets) -> void {
-		if (i == int(stallings_graph.Size())) {
-			Graph qt;
-			stallings_graph.ComputeQuotient(qt, ss);
-			Subgroup nsg(qt);
-			// Check if this subgroup is different from the previous ones.
-			for (const Subgroup& sgr : result) if (sgr.Equals(nsg)) return;
-			result.push_back(move(nsg));
-			return;
-		}
-		for (int j = 0; j < subsets; ++j) {
-			ss[i] = j;
-			Backtracking(i + 1, subsets);
-		}
-		ss[i] = subsets;
-		Backtracking(i + 1, subsets + 1);
-	};
+vector<Subgroup> Subgroup::ComputeFringe() const {
+	// Every subgroup of the fringe is the quotient of the Stallings graph by
+	// exactly one partition closed under folding, so there are no repeats.
+	// With several threads, split the search by its first choices.
+	Fold();
+	vector<vector<int>> tasks(1);
+	int threads = Parallel::NumThreads();
+	int depth = 0;
+	while (threads > 1 and int(tasks.size()) < FRINGE_TASKS_PER_THREAD * threads) {
+		vector<vector<int>> next;
+		CongruenceSearch(stallings_graph).Run(vector<int>(), depth + 1,
+				[&next](const vector<int>& choices) { next.push_back(choices); });
+		if (next.size() == tasks.size()) break;  // The search is not deeper.
+		tasks.swap(next);
+		++depth;
+	}
 
-	Backtracking(0, 0);
+	vector<vector<Subgroup>> found(tasks.size());
+	Parallel::ForEach(tasks.size(), [this, &tasks, &found](int task) {
+		CongruenceSearch search(stallings_graph);
+		search.Run(tasks[task], -1, [this, &search, &found, task](const vector<int>&) {
+			Graph qt;
+			stallings_graph.ComputeQuotient(qt, search.Blocks());
+			found[task].push_back(Subgroup(qt, GEODESIC_TREE));
+		});
+	});
 
+	vector<Subgroup> result;
+	for (vector<Subgroup>& part : found) {
+		for (Subgroup& sg : part) result.push_back(move(sg));
+	}
 	return result;
 }
 
 vector<Subgroup> Subgroup::GetAlgebraicExtensions() const {
-	vector<Subgroup> ae;
+	ResultCache::Result cached;
+	if (ResultCache::Find(ResultCache::ALGEBRAIC_EXTENSIONS, CanonicalForm(), cached)) {
+		return FromBases(cached.bases);
+	}
+	vector<Subgroup> ae = ComputeAlgebraicExtensions();
+	cached.bases = Bases(ae);
+	ResultCache::Store(ResultCache::ALGEBRAIC_EXTENSIONS, CanonicalForm(), cached);
+	return ae;
+}
+
+vector<Subgroup> Subgroup::ComputeAlgebraicExtensions() const {
 	vector<Subgroup> fringe = GetFringe();
 	// The set of algebraic extensions is the set of subgroups that do not have any
-	// free factor in the fringe (a Takahasi family). This can be done more efficiently.
+	// proper free factor in the fringe (a Takahasi family). Such a free factor has
+	// smaller rank, and it can be taken algebraic: the algebraic closure of this
+	// subgroup in K is an algebraic extension and a free factor of K. So go up by
+	// rank, and test every K only against the algebraic extensions found so far.
 	int n = fringe.size();
-	for (int i = 0; i < n; ++i) {
+	vector<int> order(n);
+	for (int i = 0; i < n; ++i) order[i] = i;
+	stable_sort(order.begin(), order.end(), [&fringe](int i, int j) {
+		return fringe[i].GetBaseSize() < fringe[j].GetBaseSize();
+	});
+
+	// The graphs are compared below, fold them all at once.
+	Parallel::ForEach(n, [&fringe](int i) { fringe[i].Fold(); });
+
+	vector<int> algebraic;  // Sorted by rank.
+	vector<bool> is_algebraic(n, false);
+	for (int i : order) {
+		const Subgroup& K = fringe[i];
 		bool alg = true;
-		for (int j = 0; j < n; ++j) {
-			if (i == j) continue;
-			if (fringe[j].IsFreeFactorOf(fringe[i])) {
-				//cerr << j << " free factor of " << i << endl;
+		for (int j : algebraic) {
+			const Subgroup& J = fringe[j];
+			if (J.GetBaseSize() >= K.GetBaseSize()) break;
+			// Both are quotients of this graph, so the graph of K is a quotient of
+			// the graph of J if J is a subgroup of K.
+			if (J.stallings_graph.Size() < K.stallings_graph.Size()) continue;
+			if (J.IsFreeFactorOf(K)) {
 				alg = false;
 				break;
 			}
 		}
-		if (alg) ae.push_back(fringe[i]);
+		if (alg) {
+			algebraic.push_back(i);
+			is_algebraic[i] = true;
+		}
+	}
+
+	vector<Subgroup> ae;
+	for (int i = 0; i < n; ++i) {
+		if (is_algebraic[i]) ae.push_back(move(fringe[i]));
 	}
 	return ae;
 }
 
 bool Subgroup::Equals(const Subgroup& sg) const {
-	assert(is_folded and sg.IsFolded());
-	return stallings_graph.IsIsomorphic(sg.stallings_graph);
+	return CanonicalForm() == sg.CanonicalForm();
 }
 
 bool Subgroup::IsSubgroupOf(const Subgroup& sg) const {
-	assert(is_folded and sg.IsFolded());
-	for (const Element& element : base) {
+	for (const Element& element : GetBase()) {
 		if (not sg.Contains(element)) return false;
 	}
 	return true;
 }
 
 bool Subgroup::IsFreeFactorOf(const Subgroup& sg) const {
+	ResultCache::Result cached;
+	string key = PairKey(*this, sg);
+	if (ResultCache::Find(ResultCache::FREE_FACTOR, key, cached)) return cached.value;
+	cached.value = ComputeIsFreeFactorOf(sg);
+	ResultCache::Store(ResultCache::FREE_FACTOR, key, cached);
+	return cached.value;
+}
+
+bool Subgroup::ComputeIsFreeFactorOf(const Subgroup& sg) const {
 	if (not IsSubgroupOf(sg)) return false;
 	int rank = sg.GetBaseSize();
 	vector<Element> ng;
@@ -350,93 +898,170 @@ bool Subgroup::IsFreeFactorOf(const Subgroup& sg) const {
 
 Element Subgroup::Inverse(const Element& element) {
 	Element ele;
-	for (int i = int(element.size()) - 1; i >= 0; --i) ele.push_back(-element[i]);
+	InverseInto(element, ele);
 	return ele;
 }
 
 Element Subgroup::Product(const Element& a, const Element& b) {
-	Element p(a.size() + b.size());
-	int k = 0;
-	for (const int& f : a) {
-		if (k == 0 or p[k - 1] != -f) p[k++] = f;
-		else if (k > 0) --k;
-	}
-	for (const int& f : b) {
-		if (k == 0 or p[k - 1] != -f) p[k++] = f;
-		else if (k > 0) --k;
-	}
-	p.resize(k);
+	Element p;
+	ProductInto(a, b, p);
 	return p;
 }
 
 Element Subgroup::Reduce(const Element& element) {
-	Element res;
-	for (const int& factor : element) {
-		if (res.empty() or res.back() != -factor) res.push_back(factor);
-		else res.pop_back();
-	}
+	Element res(element);
+	ReduceInPlace(res);
 	return res;
 }
 
-Subgroup Subgroup::Intersection(const Subgroup& H, const Subgroup& K) {
-	assert(H.IsFolded());
-	assert(K.IsFolded());
-	Graph pb = Graph::PullBack(H.stallings_graph, K.stallings_graph);
-
-	// Trimming
-	vector<int> deg(pb.Size());
-	for (int i = 0; i < pb.Size(); ++i) deg[i] = pb[i].size();
-	for (int i = 0; i < pb.Size(); ++i) {
-		int p = i;
-		while (p != 0 and deg[p] == 1) {
-			--deg[p];
-			for (int j = 0; j < int(pb[p].size()); ++j) if (deg[pb[p][j].v] != 0) {
-				p = pb[p][j].v; --deg[p];
-				break;
-			}
-		}
+void Subgroup::InverseInto(const Element& element, Element& out) {
+	if (&out != &element) out.assign(element.begin(), element.end());
+	reverse(out.begin(), out.end());
+	for (int& factor : out) factor = -factor;
+}
+
+void Subgroup::ProductInto(const Element& a, const Element& b, Element& out) {
+	assert(&out != &b);
+	if (&out != &a) out.assign(a.begin(), a.end());
+	ReduceInPlace(out);
+	// Cancel at the junction. The result is reduced unless b was not.
+	int i = 0;
+	while (i < int(b.size()) and not out.empty() and out.back() == -b[i]) {
+		out.pop_back();
+		++i;
 	}
-	// We remove from the graphs the vertex with deg == 0 (except the root)
-
-	// TODO Connected components. Currently we only get the main cc.
-	stack<int> st;
-	st.push(0);
-	deg[0] = -1; // -1 means it will be in the graph
-	while (not st.empty()) {
-		int u = st.top();
-		st.pop();
-		int e = pb[u].size();
-		for (int i = 0; i < e; ++i) {
-			if (deg[pb[u][i].v] > 0) { // Not removed and not seen
-				deg[pb[u][i].v] = -1;
-				st.push(pb[u][i].v);
-			}
+	int junction = out.size();
+	out.insert(out.end(), b.begin() + i, b.end());
+	if (FindCancellation(out, junction - 1) != -1) ReduceInPlace(out);
+}
+
+void Subgroup::ReduceInPlace(Element& element) {
+	// The reduced prefix [0, k) grows like a stack over the same vector. The
+	// letters up to the next cancellation of the rest are pushed all at once.
+	int n = element.size();
+	int k = 0, j = 0;
+	while (j < n) {
+		if (k > 0 and element[k - 1] == -element[j]) {
+			--k;
+			++j;
+			continue;
 		}
+		int next = FindCancellation(element, j);
+		int end = (next == -1 ? n : next + 1);
+		if (k != j) copy(element.begin() + j, element.begin() + end, element.begin() + k);
+		k += end - j;
+		j = end;
 	}
+	element.resize(k);
+}
+
+void Subgroup::CyclicReduceInPlace(Element& element) {
+	ReduceInPlace(element);
+	int n = element.size(), k = 0;
+	while (2 * k + 1 < n and element[k] == -element[n - k - 1]) ++k;
+	if (k == 0) return;
+	element.erase(element.end() - k, element.end());
+	element.erase(element.begin(), element.begin() + k);
+}
 
-	int k = 0; // Nodes in the new graph.
-	for (int i = 0; i < pb.Size(); ++i) {
-		if (deg[i] == -1) deg[i] = k++;
-		else deg[i] = -1;
+int Subgroup::FindCancellation(const Element& element, int from) {
+	int n = element.size();
+	const int* data = element.data();
+	int i = max(0, from);
+#ifdef __SSE2__
+	// Four pairs at a time: the letters cancel iff their sum is 0.
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 4 < n; i += 4) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+		__m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 1));
+		int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_add_epi32(x, y), zero)));
+		if (mask != 0) return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i + 1 < n; ++i) {
+		if (data[i] == -data[i + 1]) return i;
 	}
+	return -1;
+}
 
-	Graph gHK;
-	gHK.Resize(k);
-	for (int i = 0; i < pb.Size(); ++i) {
-		if (deg[i] != -1) {
-			int u = deg[i];
-			for (const Edge& edge : pb[i]) {
-				if (deg[edge.v] != -1) {
-					int v = deg[edge.v];
-					gHK[u].push_back(Edge(v, edge.label));
-				}
-			}
-		}
+Subgroup Subgroup::Intersection(const Subgroup& H, const Subgroup& K) {
+	H.ComputeTransitions();
+	K.ComputeTransitions();
+	ResultCache::Result cached;
+	string key = PairKey(H, K);
+	if (ResultCache::Find(ResultCache::INTERSECTION, key, cached)) return Subgroup(cached.bases[0]);
+	// Only the main connected component, see IntersectionComponents.
+	Subgroup HK(Graph::CorePullBack(H.transitions, K.transitions), GEODESIC_TREE);
+	cached.bases.push_back(HK.GetBase());
+	ResultCache::Store(ResultCache::INTERSECTION, key, cached);
+	return HK;
+}
+
+Subgroup Subgroup::Intersection(const vector<Subgroup>& subgroups) {
+	assert(not subgroups.empty());
+	vector<Subgroup> sgs(subgroups);
+	// (size of the graph, index in sgs), smallest first.
+	priority_queue<pair<int, int>, vector<pair<int, int>>, greater<pair<int, int>>> pending;
+	for (int i = 0; i < int(sgs.size()); ++i) {
+		sgs[i].ComputeTransitions();
+		pending.push(make_pair(sgs[i].transitions.Size(), i));
+	}
+	while (pending.size() > 1) {
+		int i = pending.top().second;
+		pending.pop();
+		int j = pending.top().second;
+		pending.pop();
+		sgs.push_back(Intersection(sgs[i], sgs[j]));
+		if (sgs.back().GetBaseSize() == 0) break;  // Trivial, nothing else to do.
+		sgs.back().ComputeTransitions();
+		pending.push(make_pair(sgs.back().transitions.Size(), int(sgs.size()) - 1));
 	}
+	if (sgs.size() == subgroups.size()) return sgs[0];
+	return sgs.back();
+}
 
-	Subgroup HK(gHK);
+vector<pair<Element, Subgroup>> Subgroup::IntersectionComponents(const Subgroup& H,
+		const Subgroup& K) {
+	H.Fold();
+	K.Fold();
+	vector<pair<int, int>> roots;
+	vector<Graph> components = Graph::PullBackComponents(H.transitions, K.transitions, roots);
 
-	return HK;
+	// Shortest paths from the root of each graph to every node.
+	vector<Edge> prevH, prevK;
+	vector<int> distH, distK;
+	H.stallings_graph.AllShortestPaths(prevH, distH);
+	K.stallings_graph.AllShortestPaths(prevK, distK);
+	auto PathTo = [](const vector<Edge>& prev, const vector<int>& dist, int u) {
+		Element path(dist[u]);
+		while (dist[u] > 0) {
+			path[dist[u] - 1] = -prev[u].label;
+			u = prev[u].v;
+		}
+		return path;
+	};
+
+	vector<pair<Element, Subgroup>> result;
+	for (int i = 0; i < int(components.size()); ++i) {
+		Subgroup C(components[i], GEODESIC_TREE);
+		// If u and v are the paths to the root (p, q) of the component, the
+		// component is u^-1 H u ^ v^-1 K v, so H ^ gKg^-1 = u C u^-1 with g = uv^-1.
+		Element u = PathTo(prevH, distH, roots[i].first);
+		Element v = PathTo(prevK, distK, roots[i].second);
+		if (u.empty() and v.empty()) {
+			result.push_back(make_pair(Element(), move(C)));
+			continue;
+		}
+		Element u_inverse;
+		InverseInto(u, u_inverse);
+		vector<Element> conjugated(C.GetBaseSize());
+		for (int j = 0; j < C.GetBaseSize(); ++j) {
+			ProductInto(u, C.GetBase()[j], conjugated[j]);
+			ProductInto(conjugated[j], u_inverse, conjugated[j]);
+		}
+		result.push_back(make_pair(Product(u, Inverse(v)), Subgroup(conjugated)));
+	}
+	return result;
 }
 
 }  // namespace stallings
@@ -459,26 +1084,7 @@ ostream& operator<<(ostream& out, const stallings::Element& element) {
 }
 
 istream& operator>>(istream& in, stallings::Element& element) {
-	element.clear();
-	string line;
-	do {
-		getline(in, line);
-	} while (line.empty());
-	stringstream ss(line);
-	string factor;
-	while (ss >> factor) {
-		int f = 1;
-		int p = 0;
-		if (factor[p] == '-') {
-			f = -1;
-			++p;
-		}
-		int num = 0;
-		while ('0' <= factor[p] and factor[p] <= '9') num = 10 * num + int(factor[p++] - '0');
-		if ((f == 1 and p == 0) or (f == -1 and p == 1)) num = 1;
-		assert(p + 1 == int(factor.size()));
-		assert('a' <= factor[p]);
-		while (num--) element.push_back(f * int(factor[p] - 'a' + 1));
-	}
+	stallings::Parser parser(in);
+	if (not parser.Word(element)) in.setstate(ios_base::failbit);
 	return in;
 }
@@ -21,6 +21,11 @@
 #include <vector>
 #include <map>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <functional>
+#include <atomic>
+#include <mutex>
 
 #include <graph.hpp>
 #include <folding.hpp>
@@ -29,48 +34,114 @@ namespace stallings {
 
 typedef std::vector<int> Element;
 
+// A flag that can be read while another thread sets it. Copies are new flags
+// with the same value.
+class LazyFlag {
+ public:
+	LazyFlag(bool value_ = false) : value(value_) {}
+	LazyFlag(const LazyFlag& flag) : value(bool(flag)) {}
+	LazyFlag& operator=(const LazyFlag& flag) {
+		return *this = bool(flag);
+	}
+	LazyFlag& operator=(bool value_) {
+		value.store(value_, std::memory_order_release);
+		return *this;
+	}
+	operator bool() const {
+		return value.load(std::memory_order_acquire);
+	}
+
+ private:
+	std::atomic<bool> value;
+};
+
+// A mutex that copies do not share: the copy of an object gets its own.
+struct LazyMutex {
+	LazyMutex() {}
+	LazyMutex(const LazyMutex&) {}
+	LazyMutex& operator=(const LazyMutex&) {
+		return *this;
+	}
+	std::recursive_mutex mutex;
+};
+
+// The constructors only keep the base or the graph given. The base, the
+// Stallings graph and the coordinates are computed on first use, so a subgroup
+// that is never queried costs almost nothing.
+// They are computed under the lock of the subgroup, and the flags that tell
+// they are done are set last, so const queries can be made on the same
+// subgroup from several threads. Copying or assigning a subgroup while another
+// thread uses it is not safe.
 class Subgroup {
  public:
+	// How the base of a subgroup given by a graph is taken: one element per
+	// edge out of a spanning tree. With a geodesic (breadth first) tree of a
+	// folded graph the base is Nielsen reduced, and usually much shorter.
+	enum BaseTree { ANY_TREE, GEODESIC_TREE };
+
 	Subgroup(); //Empty subgroup
 	explicit Subgroup(const std::vector<Element>& base_);
-	explicit Subgroup(const Graph& graph);
+	explicit Subgroup(const Graph& graph, BaseTree tree = ANY_TREE);
 
 	// Print the Stallings Graph.
 	void ShowGraph() const {
+		Fold();
 		stallings_graph.Show();
 	}
 	
 	void ShowFoldings() const;
-	void ShowStallingsGraph() const;
+	void ShowStallingsGraph(std::ostream& out = std::cout) const;
+
+	// The Stallings graph, folding it if needed.
+	const Graph& GetStallingsGraph() const {
+		Fold();
+		return stallings_graph;
+	}
 	
 	// Show the subgroup base. It doesn't check if the elements in the
 	// base are independent.
 	void ShowBase() const;
 	
 	int GetBaseSize() const;
-	const std::vector<Element>& GetBase() const { return base; }
+	const std::vector<Element>& GetBase() const {
+		ComputeBase();
+		return base;
+	}
 	Element GetBaseElement(int idx) const;
 
 	// Add element as a 'petal' to graph.
 	static void AddElement(const Element& element, Graph& graph);
+
+	// A base of the subgroup given by a (connected) graph.
+	static std::vector<Element> GraphBase(const Graph& graph, BaseTree tree = ANY_TREE);
 	
 	
 	bool IsFolded() const {
 		return is_folded;
 	}
 	
-	// Make foldings until the graph is folded.
-	void Fold();
+	// Make foldings until the graph is folded. Done by the queries that need
+	// the Stallings graph, there is no need to call it.
+	void Fold() const;
 	
 	// Find a duplicate edge, return true if found.
 	bool FindFolding(Folding& fold) const;
 	
-	// Perform a folding.
-	void DoFolding(Folding& fold);
+	// Perform a folding in 'graph', storing the previous graph in 'fold'.
+	static void DoFolding(Graph& graph, Folding& fold);
+
+	// The foldings applied to the original graph, one by one. Fold() does not
+	// need them, so they are only recorded on first use.
+	const FoldHistory& GetFoldHistory() const;
 	
 	// Return true if element is a member of the subgroup.
 	bool Contains(const Element& element) const;
 
+	// Same as Contains, for many elements at once. The walks of several
+	// elements are interleaved to hide the memory latency, and the elements
+	// are split across Parallel::NumThreads() threads.
+	std::vector<bool> ContainsBatch(const std::vector<Element>& elements) const;
+
 	// Return a path in the graph to obtain 'element'.
 	Path GetPath(const Element& element) const;
 
@@ -82,12 +153,34 @@ class Subgroup {
 	int Index() const; // Deduces the rank from the max label in the graph.
 	std::vector<Element> GetCosets() const;
 
-	// Return the subgroups in the fringe of this subgroup.
+	// Return the subgroups in the fringe of this subgroup. The results of
+	// GetFringe, GetAlgebraicExtensions, Intersection and IsFreeFactorOf are
+	// kept in the ResultCache.
 	std::vector<Subgroup> GetFringe() const;
 
 	// Return the algebraic extensions of this subgroup.
 	std::vector<Subgroup> GetAlgebraicExtensions() const;
 
+	// Identifies the subgroup: two subgroups are equal iff their canonical
+	// forms (see FoldedGraph::CanonicalForm) are equal.
+	const std::string& CanonicalForm() const;
+	size_t Hash() const {
+		return std::hash<std::string>()(CanonicalForm());
+	}
+
+	// Append the subgroup to 'out': its base, its Stallings graph (see
+	// FoldedGraph::Serialize) and, if asked, the coordinates of its edges, each
+	// after its size.
+	void Serialize(std::vector<int>& out, bool with_coordinates) const;
+
+	// The subgroup written by Serialize at 'data', read in place: the queries
+	// that only walk the graph use that memory, kept alive by 'storage'. The
+	// base and the coordinates are read on first use. Return false if the
+	// sizes are wrong, or if the graph, a letter of the base or of the
+	// coordinates is out of range.
+	static bool View(const int* data, int size, std::shared_ptr<const void> storage,
+			Subgroup& sg);
+
 	// Inclusions.
 	bool Equals(const Subgroup& sg) const;
 	bool IsSubgroupOf(const Subgroup& sg) const;
@@ -96,19 +189,94 @@ class Subgroup {
 	static Element Inverse(const Element& element);
 	static Element Product(const Element& a, const Element& b);
 	static Element Reduce(const Element& element);
+
+	// Same, writing into 'out' to reuse its memory. 'out' may be 'a' (or
+	// 'element'), but not 'b'.
+	static void InverseInto(const Element& element, Element& out);
+	static void ProductInto(const Element& a, const Element& b, Element& out);
+	static void ReduceInPlace(Element& element);
+	// Reduces the element and removes the letters at both ends that cancel,
+	// leaving the cyclically reduced conjugate.
+	static void CyclicReduceInPlace(Element& element);
+	// First i >= from such that the letters i and i + 1 cancel, -1 if none.
+	// Uses SSE2 where available, so checking that a long word is reduced is cheap.
+	static int FindCancellation(const Element& element, int from = 0);
 	static Subgroup Intersection(const Subgroup& H, const Subgroup& K);
 
+	// Intersection of all the subgroups. The two smallest graphs are always
+	// intersected first, to keep the intermediate products small.
+	static Subgroup Intersection(const std::vector<Subgroup>& subgroups);
+
+	// Every non-trivial intersection H ^ gKg^-1, one per double coset HgK, as
+	// pairs (g, H ^ gKg^-1). If H ^ K is not trivial, it goes first (g = 1).
+	static std::vector<std::pair<Element, Subgroup>> IntersectionComponents(
+			const Subgroup& H, const Subgroup& K);
+
 	const static int INFINIT_INDEX = -1;
-	const static int MAX_FRINGE_NODES = 12;
+	const static int BATCH_LANES = 8;  // Elements walked at the same time.
+	const static int BATCH_GRAIN = 4096;  // Minimum elements per thread.
+	const static int FRINGE_TASKS_PER_THREAD = 16;  // To balance the fringe.
+	const static int COORDINATE_SOURCES = 8;  // Vertices a lift may go around to, per edge.
 	
  private:
-	std::vector<Element> base;
-	std::vector<Folding> foldings;
-	Graph stallings_graph;
-	std::map<Edge, int> coordinates;
+	// Spanning tree of the given graph, one element per edge outside of it.
+	void ComputeBase() const;
+	// Word in the base of every vertex of unfolded_graph, folding the petals
+	// again with words.
+	void ComputeCoordinates() const;
+	// Base element (negative if inverted) that is the word of the edge at
+	// position i of the adjacency list of the vertex u of unfolded_graph, 0
+	// for none. Only the first edge of every petal has one.
+	int UnfoldedEdgeWord(int u, int i) const;
+	// Only the transitions, for the queries that walk the graph. Folds, unless
+	// they were read by View.
+	void ComputeTransitions() const;
+
+	// The operations themselves, without the cache.
+	std::vector<Subgroup> ComputeFringe() const;
+	std::vector<Subgroup> ComputeAlgebraicExtensions() const;
+	bool ComputeIsFreeFactorOf(const Subgroup& sg) const;
+
+	// Everything is computed on first use, so it is all mutable. The
+	// computations take 'lazy', and check their flag again once they have it.
+	mutable LazyMutex lazy;
+	BaseTree base_tree;
+	mutable Graph given_graph;  // Until the base is computed from it.
+	mutable std::vector<Element> base;
+	mutable Graph stallings_graph;
+	mutable FoldedGraph transitions;  // Same as stallings_graph, for the queries.
+	mutable LazyFlag has_transitions;
+	mutable std::string canonical_form;
+	mutable LazyFlag has_canonical_form;
+	mutable Graph unfolded_graph;  // The graph before folding, with a petal per element.
+	mutable std::vector<int> unfolded_map;  // Vertex of stallings_graph of every vertex of it.
+	mutable FoldHistory fold_history;
+	mutable LazyFlag has_fold_history;
+	// Word in the base of every vertex of unfolded_graph (see
+	// Folder::VertexWords). GetCoordinates lifts the path of an element to
+	// unfolded_graph, going from a vertex to another one of its class through
+	// the root where the petal it is on does not go on.
+	mutable std::vector<Element> vertex_coordinates;
+	// For every edge of stallings_graph, parallel to its adjacency lists, the
+	// vertices of unfolded_graph with an edge that ends up there, the
+	// COORDINATE_SOURCES with the shortest words.
+	mutable std::vector<std::vector<std::vector<int>>> edge_sources;
+	// The positions of the edges of every label (offset by the maximum label)
+	// in the adjacency list of the vertex 0 of unfolded_graph.
+	mutable std::vector<std::vector<int>> base_edges;
+	// Base element of the first edge of every other vertex, 0 for none.
+	mutable std::vector<int> first_edge_word;
+	mutable LazyFlag has_coordinates;
 	
-	bool has_base;
-	bool is_folded;
+	mutable LazyFlag has_base;
+	mutable LazyFlag is_folded;
+
+	// The sections of Serialize, for a View.
+	std::shared_ptr<const void> storage;
+	const int* stored_base;
+	int stored_base_size;
+	mutable const int* stored_coordinates;  // Dropped if the base is.
+	int stored_coordinates_size;
 };
 
 }  // namespace stallings
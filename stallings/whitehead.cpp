@@ -16,12 +16,179 @@
 */
 
 #include <whitehead.hpp>
+#include <parallel.hpp>
+#include <word.hpp>
+#include <atomic>
 #include <cassert>
+#include <limits>
+#include <queue>
 
 using namespace std;
 
 namespace stallings {
 
+namespace {
+
+// Vertex of the Whitehead graph for every letter: a, b, c, ... are 0, 1, 2, ...
+// and -a, -b, -c, ... are rank, rank + 1, rank + 2, ...
+int Vertex(int letter, int rank) {
+	return letter > 0 ? letter - 1 : rank - letter - 1;
+}
+
+int Letter(int vertex, int rank) {
+	return vertex < rank ? vertex + 1 : -(vertex - rank + 1);
+}
+
+int Opposite(int vertex, int rank) {
+	return vertex < rank ? vertex + rank : vertex - rank;
+}
+
+// Adjacency matrix of the Whitehead graph of the words in base, which must be
+// reduced: an edge x -- y^-1 for every subword xy. The words are read cyclically with an extra
+// letter z at the end, fixed by the automorphisms, so that the ends of the
+// words count too. Both z and -z are the vertex 2 * rank.
+vector<vector<int>> WhiteheadGraph(const vector<Element>& base, int rank) {
+	int z = 2 * rank;
+	vector<vector<int>> graph(z + 1, vector<int>(z + 1, 0));
+	auto Connect = [&graph](int u, int v) {
+		++graph[u][v];
+		++graph[v][u];
+	};
+	for (const Element& element : base) {
+		if (element.empty()) continue;
+		for (int i = 0; i + 1 < int(element.size()); ++i) {
+			Connect(Vertex(element[i], rank), Vertex(-element[i + 1], rank));
+		}
+		Connect(Vertex(element.back(), rank), z);
+		Connect(z, Vertex(-element.front(), rank));
+	}
+	return graph;
+}
+
+vector<int> Degrees(const vector<vector<int>>& graph) {
+	vector<int> degree(graph.size(), 0);
+	for (int u = 0; u < int(graph.size()); ++u) {
+		for (int w = 0; w < int(graph.size()); ++w) degree[u] += graph[u][w];
+	}
+	return degree;
+}
+
+// Cut of the mask with Gray code index m, with room for z.
+vector<bool> GrayCut(long long m, int z) {
+	long long mask = m ^ (m >> 1);
+	vector<bool> scut(z + 1, false);
+	for (int w = 0; w < z; ++w) scut[w] = (mask >> w) & 1;
+	return scut;
+}
+
+// The element that goes in or out of the cut from the Gray code index m - 1
+// to m: the lowest bit set in m (not 0).
+int GrayFlip(long long m) {
+#ifdef __GNUC__
+	return __builtin_ctzll(m);
+#else
+	int x = 0;
+	while (not ((m >> x) & 1)) ++x;
+	return x;
+#endif
+}
+
+int Capacity(const vector<vector<int>>& graph, const vector<bool>& scut) {
+	int capacity = 0;
+	for (int u = 0; u < int(graph.size()); ++u) {
+		if (not scut[u]) continue;
+		for (int w = 0; w < int(graph.size()); ++w) if (not scut[w]) capacity += graph[u][w];
+	}
+	return capacity;
+}
+
+// A candidate move: the vertex of s, the change of length, and where it was
+// found in the order of the search (-1 if none).
+struct Move {
+	Move() : index(-1), vertex(-1), delta(0) {}
+	Move(long long index, int vertex, int delta) : index(index), vertex(vertex), delta(delta) {}
+
+	long long index;
+	int vertex;
+	int delta;
+};
+
+// The first move found, or the one with the smallest change (the first of
+// them if there are ties). The moves are in the order of the search.
+Move Choose(const vector<Move>& found, Whitehead::Strategy strategy) {
+	Move best;
+	for (const Move& move : found) {
+		if (move.index == -1) continue;
+		if (strategy == Whitehead::FIRST_IMPROVEMENT) return move;
+		if (best.index == -1 or move.delta < best.delta) best = move;
+	}
+	return best;
+}
+
+// Applies the Whitehead automorphism of s and the cut given by the vertices
+// marked in scut to every element of base.
+void Apply(int s, const vector<bool>& scut, int rank, vector<Element>& base) {
+	if (rank > Word::MAX_LETTER) {
+		set<int> letters;
+		for (int w = 0; w < 2 * rank; ++w) if (scut[w]) letters.insert(Letter(w, rank));
+		auto phi = Whitehead::GetWhitehead(s, letters);
+		for (Element& element : base) element = phi(element);
+		return;
+	}
+	// Same as GetWhitehead, but the image is reduced while it is written.
+	Word image;
+	for (Element& element : base) {
+		image.clear();
+		for (int factor : element) {
+			if (factor == s or factor == -s) {
+				image.Multiply(factor);
+				continue;
+			}
+			if (scut[Vertex(-factor, rank)]) image.Multiply(-s);
+			image.Multiply(factor);
+			if (scut[Vertex(factor, rank)]) image.Multiply(s);
+		}
+		element.assign(image.begin(), image.end());
+	}
+}
+
+// Maximum flow from s to t (Edmonds-Karp). The vertices still reachable from s
+// in the residual graph are marked in 'side', they are a minimum cut.
+int MinCut(vector<vector<int>> capacity, int s, int t, vector<bool>& side) {
+	int n = capacity.size();
+	int flow = 0;
+	while (true) {
+		vector<int> prev(n, -1);
+		prev[s] = s;
+		queue<int> q;
+		q.push(s);
+		while (not q.empty() and prev[t] == -1) {
+			int u = q.front();
+			q.pop();
+			for (int v = 0; v < n; ++v) {
+				if (prev[v] == -1 and capacity[u][v] > 0) {
+					prev[v] = u;
+					q.push(v);
+				}
+			}
+		}
+		if (prev[t] == -1) {
+			side = vector<bool>(n);
+			for (int u = 0; u < n; ++u) side[u] = prev[u] != -1;
+			return flow;
+		}
+		int push = numeric_limits<int>::max();
+		for (int v = t; v != s; v = prev[v]) push = min(push, capacity[prev[v]][v]);
+		for (int v = t; v != s; v = prev[v]) {
+			capacity[prev[v]][v] -= push;
+			capacity[v][prev[v]] += push;
+		}
+		flow += push;
+	}
+}
+
+}  // namespace
+
 function<Element(const Element&)> Whitehead::GetWhitehead(int s, const set<int>& scut) {
 	return [=](const Element& element) -> Element {
 		Element res;
@@ -33,52 +200,122 @@ function<Element(const Element&)> Whitehead::GetWhitehead(int s, const set<int>&
 				if (scut.count(factor)) res.push_back(s);
 			}
 		}
-		return Subgroup::Reduce(res);
+		Subgroup::ReduceInPlace(res);
+		return res;
 	};
 }
 
-bool Whitehead::Reduce(vector<Element>& base, int rank) {
-	int oldsize = 0, bs = base.size();
-	for (const Element& element : base) oldsize += element.size();
-	//cerr << "Current size: " << oldsize << endl;
+bool Whitehead::Reduce(vector<Element>& base, int rank, Strategy strategy,
+		long long* evaluated) {
+	assert(rank < 31);
+	// Score every cut with the Whitehead graph (see ReduceByCut) instead of
+	// rewriting the words. The masks are visited in Gray code order: every one
+	// differs from the previous in one letter, so its capacity is updated in
+	// O(rank). Only the chosen move is applied.
+	for (Element& element : base) Subgroup::ReduceInPlace(element);
+	vector<vector<int>> graph = WhiteheadGraph(base, rank);
+	int z = 2 * rank;
+	vector<int> degree = Degrees(graph);
+	long long mxmask = 1LL << (2 * rank);
 
-	int mxmask = 1 << (2 * rank);
-	for (int m = 0; m < mxmask; ++m) {
+	int tasks = max(1LL, min(mxmask / MASK_GRAIN,
+			(long long)Parallel::NumThreads() * TASKS_PER_THREAD));
+	vector<Move> found(tasks);
+	vector<long long> scored(tasks, 0);
+	atomic<long long> first(mxmask);  // Index of the first move found.
+	Parallel::ForEach(tasks, [&](int task) {
+		long long begin = max(1LL, mxmask * task / tasks);
+		long long end = mxmask * (task + 1) / tasks;
 		// [0, rank) = a, b, c, d, ...; [rank, 2 * rank) = -a, -b, -c, -d, ...
-		set<int> scut;
-		for (int i = 0; i < rank; ++i) if ((m & (1 << i))) scut.insert(i + 1);
-		for (int i = rank; i < rank + rank; ++i) if ((m & (1 << i))) scut.insert(-(i - rank + 1));
-		for (int s = -rank; s <= rank; ++s) {
-			if (s == 0) continue;
-			if (scut.count(s) and not scut.count(-s)) {
-				//cerr << s << " {";
-				//for (int k : scut) cerr << k << ",";
-				//cerr << "}" << endl;
-				auto phi = GetWhitehead(s, scut);
-				vector<Element> b2(bs);
-				int newsize = 0;
-				for (int i = 0; i < bs; ++i) {
-					b2[i] = phi(base[i]);
-					//cerr << b2[i] << endl;
-					newsize += b2[i].size();
-				}
-				//cerr << newsize << endl;
-				if (newsize < oldsize) {
-					swap(base, b2);
-					return true;
+		vector<bool> scut = GrayCut(begin - 1, z);
+		int capacity = Capacity(graph, scut);
+		Move& best = found[task];
+		for (long long m = begin; m < end; ++m) {
+			if (strategy == FIRST_IMPROVEMENT and m > first.load(memory_order_relaxed)) break;
+			int x = GrayFlip(m);
+			int inside = 0, outside = 0;
+			for (int w = 0; w <= z; ++w) {
+				if (w == x) continue;
+				if (scut[w]) inside += graph[x][w];
+				else outside += graph[x][w];
+			}
+			capacity += scut[x] ? inside - outside : outside - inside;
+			scut[x] = not scut[x];
+			++scored[task];
+
+			for (int u = 0; u < z; ++u) {
+				if (scut[u] and not scut[Opposite(u, rank)] and capacity - degree[u] < best.delta) {
+					best = Move(m, u, capacity - degree[u]);
+					if (strategy == FIRST_IMPROVEMENT) break;
 				}
 			}
+			if (strategy == FIRST_IMPROVEMENT and best.index != -1) {
+				long long current = first.load();
+				while (m < current and not first.compare_exchange_weak(current, m)) {}
+				break;
+			}
 		}
+	});
+
+	if (evaluated != nullptr) {
+		*evaluated = 0;
+		for (long long count : scored) *evaluated += count;
 	}
-	return false;
+	Move best = Choose(found, strategy);
+	if (best.index == -1) return false;
+	Apply(Letter(best.vertex, rank), GrayCut(best.index, z), rank, base);
+	return true;
+}
+
+bool Whitehead::ReduceByCut(vector<Element>& base, int rank, Strategy strategy,
+		long long* evaluated) {
+	// For the automorphism given by s and a cut A (s in A, -s not in A), the
+	// length of the words changes by the capacity of A in the Whitehead graph
+	// minus the degree of s. So look for the cut of minimum capacity that
+	// separates s from -s and z.
+	for (Element& element : base) Subgroup::ReduceInPlace(element);
+	vector<vector<int>> graph = WhiteheadGraph(base, rank);
+	int z = 2 * rank;
+	vector<int> degree = Degrees(graph);
+
+	// Every flow takes O(edges * vertices^2).
+	long long edges = 1;
+	for (int d : degree) edges += d / 2;
+	long long work = (long long)(z + 1) * (z + 1) * edges;
+	vector<Move> found(z);
+	vector<vector<bool>> cuts(z);
+	atomic<int> first(z);
+	atomic<long long> flows(0);
+	Parallel::For(z, max(1LL, CUT_GRAIN / work), [&](int begin, int end) {
+		for (int u = begin; u < end; ++u) {
+			if (strategy == FIRST_IMPROVEMENT and u > first.load()) break;
+			vector<vector<int>> capacity = graph;
+			int v = Opposite(u, rank);
+			capacity[v][z] = capacity[z][v] = numeric_limits<int>::max() / 2;
+			++flows;
+			int delta = MinCut(capacity, u, z, cuts[u]) - degree[u];
+			if (delta >= 0) continue;
+			found[u] = Move(u, u, delta);
+			if (strategy == FIRST_IMPROVEMENT) {
+				int current = first.load();
+				while (u < current and not first.compare_exchange_weak(current, u)) {}
+				break;
+			}
+		}
+	});
+
+	if (evaluated != nullptr) *evaluated = flows;
+	Move best = Choose(found, strategy);
+	if (best.index == -1) return false;
+	Apply(Letter(best.vertex, rank), cuts[best.vertex], rank, base);
+	return true;
 }
 
 bool Whitehead::WhiteheadMinimizationProblem(vector<Element> base, int rank) {
-	assert(rank < 13); // Just to put a limit.
 	//cerr << "Minimizing with rank " << rank << endl;
 	//for (const Element& element : base) cerr << element << endl;
 	//cerr << endl;
-	while (Reduce(base, rank)) {
+	while (ReduceByCut(base, rank)) {
 		//cerr << "Reduced:" << endl;
 		//for (const Element& element : base) cerr << element << endl;
 		//cerr << endl;
@@ -28,9 +28,29 @@ class Whitehead {
 	public:
 		static std::function<Element(const Element&)> GetWhitehead(int s, const std::set<int>& scut);
 
-		static bool Reduce(std::vector<Element>& base, int rank);
+		// Which move the reducers apply: the first one that reduces the length, in
+		// the sequential order, or the one that reduces it the most. The candidates
+		// are split among the threads; with FIRST_IMPROVEMENT they stop as soon as
+		// a move before theirs is found, and the result is the sequential one.
+		enum Strategy { FIRST_IMPROVEMENT, BEST_IMPROVEMENT };
+
+		// Applies a Whitehead automorphism that reduces the total length of base,
+		// trying every cut. Returns false if there is none. If 'evaluated' is not
+		// null, it gets the number of cuts scored.
+		static bool Reduce(std::vector<Element>& base, int rank,
+				Strategy strategy = FIRST_IMPROVEMENT, long long* evaluated = nullptr);
+
+		// Same as Reduce, but instead of trying every cut it finds the best one
+		// for every s as a minimum cut of the Whitehead graph of base, so it
+		// takes polynomial time in the rank. 'evaluated' gets the number of s.
+		static bool ReduceByCut(std::vector<Element>& base, int rank,
+				Strategy strategy = FIRST_IMPROVEMENT, long long* evaluated = nullptr);
 
 		static bool WhiteheadMinimizationProblem(std::vector<Element> base, int rank);
+
+		const static long long MASK_GRAIN = 1 << 14;  // Minimum cuts per task.
+		const static long long CUT_GRAIN = 1 << 20;  // Minimum flow work per thread.
+		const static int TASKS_PER_THREAD = 4;
 };
 
 }  // namespace stallings
@@ -0,0 +1,107 @@
+/*
+*   This file is part of Stallings-Calculator.
+*
+*   Stallings-Calculator is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   NSMB Editor 5 is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with Stallings-Calculator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <word.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace stallings {
+
+Word::Word(const vector<int>& element) : length(0), capacity(INLINE_LETTERS) {
+	if (int(element.size()) > capacity) Grow(element.size());
+	for (int letter : element) push_back(letter);
+}
+
+Word::Word(const Word& w) : length(0), capacity(INLINE_LETTERS) {
+	if (w.length > capacity) Grow(w.length);
+	memcpy(Data(), w.Data(), w.length);
+	length = w.length;
+}
+
+Word::Word(Word&& w) : length(0), capacity(INLINE_LETTERS) {
+	swap(*this, w);
+}
+
+Word& Word::operator=(Word w) {
+	swap(*this, w);
+	return *this;
+}
+
+void swap(Word& a, Word& b) {
+	// The inline buffer is the whole union, so swapping it also swaps the
+	// heap pointers.
+	Word::Letter tmp[Word::INLINE_LETTERS];
+	memcpy(tmp, a.buffer, sizeof(tmp));
+	memcpy(a.buffer, b.buffer, sizeof(tmp));
+	memcpy(b.buffer, tmp, sizeof(tmp));
+	std::swap(a.length, b.length);
+	std::swap(a.capacity, b.capacity);
+}
+
+void Word::Grow(int size) {
+	if (size <= capacity) return;
+	int new_capacity = max(size, 2 * capacity);
+	Letter* data = new Letter[new_capacity];
+	memcpy(data, Data(), length);
+	if (OnHeap()) delete[] heap;
+	heap = data;
+	capacity = new_capacity;
+}
+
+void Word::Multiply(const Word& w) {
+	// Below, the length of this word changes and Grow may free its buffer,
+	// so w cannot be the same word.
+	if (&w == this) {
+		Multiply(Word(w));
+		return;
+	}
+	// Cancel the end of this word with the start of w.
+	int k = 0;
+	while (k < w.length and length > 0 and Data()[length - 1] == -w.Data()[k]) {
+		--length;
+		++k;
+	}
+	if (length + w.length - k > capacity) Grow(length + w.length - k);
+	memcpy(Data() + length, w.Data() + k, w.length - k);
+	length += w.length - k;
+}
+
+void Word::Reduce() {
+	// The reduced prefix grows like a stack over the same buffer.
+	Letter* data = Data();
+	int k = 0;
+	for (int i = 0; i < length; ++i) {
+		if (k > 0 and data[k - 1] == -data[i]) --k;
+		else data[k++] = data[i];
+	}
+	length = k;
+}
+
+void Word::Invert() {
+	Letter* data = Data();
+	reverse(data, data + length);
+	for (int i = 0; i < length; ++i) data[i] = -data[i];
+}
+
+bool Word::operator==(const Word& w) const {
+	return length == w.length and memcmp(Data(), w.Data(), length) == 0;
+}
+
+}  // namespace stallings
@@ -0,0 +1,129 @@
+/*
+*   This file is part of Stallings-Calculator.
+*
+*   Stallings-Calculator is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   NSMB Editor 5 is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with Stallings-Calculator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WORD_HPP
+#define WORD_HPP
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+namespace stallings {
+
+// A word in the free group, stored as one signed byte per letter (a = 1,
+// -a = -1, ...). Words up to INLINE_LETTERS letters are kept inside the object,
+// only longer ones go to the heap. It converts to and from Element
+// (std::vector<int>), which is still the type of the words everywhere else:
+// for now it is only used inside the Whitehead automorphisms, where the
+// letters are rewritten many times.
+class Word {
+ public:
+	typedef int8_t Letter;
+
+	Word() : length(0), capacity(INLINE_LETTERS) {}
+	explicit Word(const std::vector<int>& element);
+	Word(const Word& w);
+	Word(Word&& w);
+	Word& operator=(Word w);
+	~Word() {
+		if (OnHeap()) delete[] heap;
+	}
+
+	int size() const {
+		return length;
+	}
+	bool empty() const {
+		return length == 0;
+	}
+	int operator[](int idx) const {
+		return Data()[idx];
+	}
+	int back() const {
+		return Data()[length - 1];
+	}
+	const Letter* begin() const {
+		return Data();
+	}
+	const Letter* end() const {
+		return Data() + length;
+	}
+
+	void clear() {
+		length = 0;
+	}
+	void pop_back() {
+		--length;
+	}
+	// Appends a letter, without reducing.
+	void push_back(int letter) {
+		assert(letter != 0 and letter >= -MAX_LETTER and letter <= MAX_LETTER);
+		if (length == capacity) Grow(length + 1);
+		Data()[length++] = letter;
+	}
+
+	// Appends a letter, cancelling it with the last one if they are inverses.
+	// If the word is reduced, it stays reduced.
+	void Multiply(int letter) {
+		if (length > 0 and Data()[length - 1] == -letter) --length;
+		else push_back(letter);
+	}
+	// Same, with a whole word, which may be this one.
+	void Multiply(const Word& w);
+
+	// Free reduction, in place.
+	void Reduce();
+	// Replaces the word by its inverse, in place.
+	void Invert();
+
+	std::vector<int> ToElement() const {
+		return std::vector<int>(begin(), end());
+	}
+
+	bool operator==(const Word& w) const;
+	bool operator!=(const Word& w) const {
+		return not (*this == w);
+	}
+
+	friend void swap(Word& a, Word& b);
+
+	const static int INLINE_LETTERS = 24;  // sizeof(Word) == 32.
+	const static int MAX_LETTER = 127;
+
+ private:
+	bool OnHeap() const {
+		return capacity > INLINE_LETTERS;
+	}
+	Letter* Data() {
+		return OnHeap() ? heap : buffer;
+	}
+	const Letter* Data() const {
+		return OnHeap() ? heap : buffer;
+	}
+
+	// Makes room for at least 'size' letters.
+	void Grow(int size);
+
+	int32_t length, capacity;
+	union {
+		Letter buffer[INLINE_LETTERS];
+		Letter* heap;
+	};
+};
+
+}  // namespace stallings
+
+#endif // WORD_HPP